@@ -0,0 +1,123 @@
+// Scalar lookups against hash_table_lookup_batch() on a table much larger
+// than the last-level cache, where every probe is a cache miss.
+//
+// Usage: bench_batch [log2_entries]
+//
+// Fills a table with 2^log2_entries (default 2^24) inline uint64_t keys
+// and values, then looks every key up in a random order: once through
+// hash_table_lookup() and once per batch size through
+// hash_table_lookup_batch(). Bulk insertion is compared the same way.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t hash_u64(const void *key) { return *(const uint64_t *)key; }
+
+static HashTable *create_table(hash_table_engine engine, size_t n) {
+  type_handler key_handler = {.equal = equal_u64, .hash = hash_u64};
+  type_handler value_handler = {0};
+  hash_table_options options = {.engine = engine,
+                                .key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint64_t),
+                                .initial_capacity = n};
+  return hash_table_create_with_options(key_handler, value_handler, NULL,
+                                        &options);
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 24;
+  if (log2_entries < 10 || log2_entries > 30) {
+    fprintf(stderr, "log2_entries must be between 10 and 30\n");
+    return 1;
+  }
+  size_t n = (size_t)1 << log2_entries;
+  const size_t batch_sizes[] = {16, 64, 256};
+  const struct {
+    const char *name;
+    hash_table_engine engine;
+  } engines[] = {{"linear", HASH_TABLE_ENGINE_LINEAR},
+                 {"swiss", HASH_TABLE_ENGINE_SWISS},
+                 {"robin", HASH_TABLE_ENGINE_ROBIN_HOOD}};
+
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  const void **key_ptrs = malloc(sizeof(void *) * n);
+  const void **order = malloc(sizeof(void *) * n);
+  void **out = malloc(sizeof(void *) * n);
+  if (!keys || !key_ptrs || !order || !out) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = next_random();
+    key_ptrs[i] = &keys[i];
+    order[i] = &keys[i];
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    const void *tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  printf("%zu entries, ns per key\n", n);
+  printf("%-8s %-14s %10s %10s\n", "engine", "mode", "insert", "lookup");
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    HashTable *table = create_table(engines[e].engine, n);
+    double start = now_ns();
+    for (size_t i = 0; i < n; i++) {
+      hash_table_insert(table, (void *)key_ptrs[i], (void *)key_ptrs[i]);
+    }
+    double insert_ns = (now_ns() - start) / n;
+
+    start = now_ns();
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++) {
+      found += hash_table_lookup(table, order[i]) != NULL;
+    }
+    double lookup_ns = (now_ns() - start) / n;
+    if (found != n) {
+      fprintf(stderr, "%s: lost keys\n", engines[e].name);
+      return 1;
+    }
+    printf("%-8s %-14s %10.1f %10.1f\n", engines[e].name, "scalar", insert_ns,
+           lookup_ns);
+    hash_table_destroy(table);
+
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+      size_t batch = batch_sizes[b];
+      table = create_table(engines[e].engine, n);
+      start = now_ns();
+      for (size_t i = 0; i < n; i += batch) {
+        size_t count = n - i < batch ? n - i : batch;
+        hash_table_insert_batch(table, key_ptrs + i, key_ptrs + i, count);
+      }
+      insert_ns = (now_ns() - start) / n;
+
+      start = now_ns();
+      found = 0;
+      for (size_t i = 0; i < n; i += batch) {
+        size_t count = n - i < batch ? n - i : batch;
+        found += hash_table_lookup_batch(table, order + i, count, out + i);
+      }
+      lookup_ns = (now_ns() - start) / n;
+      if (found != n) {
+        fprintf(stderr, "%s: lost keys in batch mode\n", engines[e].name);
+        return 1;
+      }
+      char mode[32];
+      snprintf(mode, sizeof(mode), "batch %zu", batch);
+      printf("%-8s %-14s %10.1f %10.1f\n", engines[e].name, mode, insert_ns,
+             lookup_ns);
+      hash_table_destroy(table);
+    }
+  }
+
+  free(keys);
+  free(key_ptrs);
+  free(order);
+  free(out);
+  return 0;
+}
@@ -0,0 +1,102 @@
+// A bounded table used as a cache in front of a backend, on a skewed key
+// distribution.
+//
+// Usage: bench_cache [log2_keys]
+//
+// Requests draw keys from 2^log2_keys (default 2^22) with a Zipf skew of
+// exponent 1. Each request looks the key up and, on a miss, inserts it, as a
+// read-through cache would after asking the backend. For caches holding a
+// few shares of the key space, reports the hit ratio and the nanoseconds
+// per request, against a cache that evicts a random entry instead of using
+// the CLOCK flags.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REQUESTS 4000000
+
+// Ranks spread evenly over the powers of two below 2^log2_keys, and
+// evenly within each, are drawn with a probability close to 1 / rank.
+// They are then hashed so that popular keys are not neighbours.
+static void zipf_keys(uint64_t *keys, size_t count, int log2_keys) {
+  for (size_t i = 0; i < count; i++) {
+    uint64_t power = (uint64_t)1 << (next_random() % log2_keys);
+    uint64_t rank = power + next_random() % power;
+    keys[i] = hash_table_hash_u64(&rank, sizeof(rank), 0);
+  }
+}
+
+// Serves the requests through a cache of the given size. With
+// random_eviction the cache deletes the key of an earlier miss picked at
+// random when it is full, instead of bounding the table.
+static void run(size_t capacity, bool random_eviction, const uint64_t *keys,
+                size_t count) {
+  type_handler key_handler = {.equal = equal_u64,
+                              .hash_with_seed = hash_table_hash_u64};
+  hash_table_options options = {.engine = HASH_TABLE_ENGINE_SWISS,
+                                .key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint64_t),
+                                .initial_capacity = capacity,
+                                .max_entries =
+                                    random_eviction ? 0 : capacity};
+  HashTable *table = hash_table_create_with_options(
+      key_handler, (type_handler){0}, NULL, &options);
+  uint64_t *resident = random_eviction ? malloc(sizeof(uint64_t) * capacity)
+                                       : NULL;
+  if (!table || (random_eviction && !resident)) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  size_t hits = 0, filled = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < count; i++) {
+    if (hash_table_lookup(table, &keys[i])) {
+      hits++;
+      continue;
+    }
+    if (random_eviction) {
+      if (filled < capacity) {
+        resident[filled++] = keys[i];
+      } else {
+        size_t victim = next_random() % capacity;
+        hash_table_delete(table, &resident[victim]);
+        resident[victim] = keys[i];
+      }
+    }
+    hash_table_insert(table, (void *)&keys[i], (void *)&keys[i]);
+  }
+  double ns = (now_ns() - start) / count;
+  printf("%10zu %-8s %9.1f%% %10.1f\n", capacity,
+         random_eviction ? "random" : "clock", 100.0 * hits / count, ns);
+  hash_table_destroy(table);
+  free(resident);
+}
+
+int main(int argc, char **argv) {
+  int log2_keys = argc > 1 ? atoi(argv[1]) : 22;
+  if (log2_keys < 12 || log2_keys > 28) {
+    fprintf(stderr, "log2_keys must be between 12 and 28\n");
+    return 1;
+  }
+  size_t universe = (size_t)1 << log2_keys;
+  uint64_t *keys = malloc(sizeof(uint64_t) * REQUESTS);
+  if (!keys) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  zipf_keys(keys, REQUESTS, log2_keys);
+
+  printf("%d requests over %zu keys\n", REQUESTS, universe);
+  printf("%10s %-8s %10s %10s\n", "entries", "eviction", "hits", "ns/req");
+  const double shares[] = {0.001, 0.01, 0.1};
+  for (size_t s = 0; s < sizeof(shares) / sizeof(shares[0]); s++) {
+    size_t capacity = (size_t)(universe * shares[s]);
+    run(capacity, false, keys, REQUESTS);
+    run(capacity, true, keys, REQUESTS);
+  }
+  free(keys);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef CUSTOM_HASH_TABLE_BENCH_COMMON_H
+#define CUSTOM_HASH_TABLE_BENCH_COMMON_H
+
+// Helpers shared by the benchmarks. Include after defining _POSIX_C_SOURCE
+// (or _GNU_SOURCE), which clock_gettime() needs.
+
+#include "hashtable.h"
+#include <time.h>
+
+static inline bool equal_u64(const void *key1, const void *key2) {
+  return *(const uint64_t *)key1 == *(const uint64_t *)key2;
+}
+
+// One xorshift64 step, for benchmarks that keep a generator per thread.
+static inline uint64_t xorshift64(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// The same sequence on every run, so that runs compare the same keys.
+static inline uint64_t next_random(void) {
+  static uint64_t state = 0x9E3779B97F4A7C15ULL;
+  return xorshift64(&state);
+}
+
+static inline double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif
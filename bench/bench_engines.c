@@ -0,0 +1,130 @@
+// Lookup throughput of each probing engine at fixed load factors.
+//
+// Usage: bench_engines [log2_capacity]
+//
+// Each run fills a table of 2^log2_capacity slots (default 2^20) to the
+// given load factor and then times successful and unsuccessful lookups of
+// every key in a shuffled order.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t hash_u64(const void *key) {
+  uint64_t x = *(const uint64_t *)key;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Keys and values live in the benchmark's own arrays, so the table only
+// stores borrowed pointers and allocation cost stays out of the numbers.
+static void *borrow(const void *original) { return (void *)original; }
+static void release(void *data) { (void)data; }
+
+static void shuffle(uint64_t *items, size_t n) {
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    uint64_t tmp = items[i];
+    items[i] = items[j];
+    items[j] = tmp;
+  }
+}
+
+static double time_lookups(const HashTable *table, const uint64_t *keys,
+                           size_t n, size_t *found) {
+  double start = now_ns();
+  size_t hits = 0;
+  for (size_t i = 0; i < n; i++) {
+    hits += hash_table_lookup(table, &keys[i]) != NULL;
+  }
+  double elapsed = now_ns() - start;
+  *found = hits;
+  return elapsed / n;
+}
+
+int main(int argc, char **argv) {
+  int log2_capacity = argc > 1 ? atoi(argv[1]) : 20;
+  if (log2_capacity < 8 || log2_capacity > 30) {
+    fprintf(stderr, "log2_capacity must be between 8 and 30\n");
+    return 1;
+  }
+  size_t capacity = (size_t)1 << log2_capacity;
+  const double load_factors[] = {0.5, 0.625, 0.75, 0.875};
+  const struct {
+    const char *name;
+    hash_table_engine engine;
+  } engines[] = {{"linear", HASH_TABLE_ENGINE_LINEAR},
+                 {"swiss", HASH_TABLE_ENGINE_SWISS},
+                 {"robin", HASH_TABLE_ENGINE_ROBIN_HOOD}};
+
+  size_t max_keys = (size_t)(capacity * 0.875);
+  uint64_t *keys = malloc(sizeof(uint64_t) * max_keys);
+  uint64_t *missing = malloc(sizeof(uint64_t) * max_keys);
+  uint64_t *order = malloc(sizeof(uint64_t) * max_keys);
+  if (!keys || !missing || !order) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  // Even numbers are inserted, odd numbers never are.
+  for (size_t i = 0; i < max_keys; i++) {
+    keys[i] = next_random() << 1;
+    missing[i] = keys[i] | 1;
+  }
+
+  type_handler key_handler = {.copy = borrow,
+                              .destroy = release,
+                              .equal = equal_u64,
+                              .hash = hash_u64};
+  type_handler value_handler = {.copy = borrow, .destroy = release};
+
+  printf("capacity %zu slots\n", capacity);
+  printf("%-8s %6s %12s %12s %12s\n", "engine", "load", "hit ns/op",
+         "miss ns/op", "hit Mops/s");
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    for (size_t l = 0; l < sizeof(load_factors) / sizeof(load_factors[0]);
+         l++) {
+      size_t n = (size_t)(capacity * load_factors[l]);
+      // Growth is held off until just past the largest measured load
+      // factor, so n keys always end up in exactly `capacity` slots.
+      hash_table_options options = {.engine = engines[e].engine,
+                                    .max_load_factor = 0.9};
+      HashTable *table = hash_table_create_with_options(
+          key_handler, value_handler, NULL, &options);
+      if (!table) {
+        fprintf(stderr, "failed to create table\n");
+        return 1;
+      }
+      for (size_t i = 0; i < n; i++) {
+        hash_table_insert(table, &keys[i], &keys[i]);
+      }
+
+      for (size_t i = 0; i < n; i++) {
+        order[i] = keys[i];
+      }
+      shuffle(order, n);
+      size_t found;
+      double hit_ns = time_lookups(table, order, n, &found);
+      if (found != n) {
+        fprintf(stderr, "%s: lost keys (%zu of %zu found)\n", engines[e].name,
+                found, n);
+        return 1;
+      }
+      double miss_ns = time_lookups(table, missing, n, &found);
+
+      printf("%-8s %6.3f %12.1f %12.1f %12.1f\n", engines[e].name,
+             load_factors[l], hit_ns, miss_ns, 1e3 / hit_ns);
+      hash_table_destroy(table);
+    }
+  }
+
+  free(keys);
+  free(missing);
+  free(order);
+  return 0;
+}
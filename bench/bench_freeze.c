@@ -0,0 +1,111 @@
+// Lookups in a table packed by hash_table_freeze() against the same
+// entries in growable SWISS and ROBIN_HOOD tables.
+//
+// Usage: bench_freeze [log2_entries]
+//
+// Inserts 2^log2_entries (default 2^22) random uint64_t keys with 8-byte
+// values into each growable table, looks every key up in a random order,
+// then looks up as many absent keys. The ROBIN_HOOD table is then frozen
+// and looked up the same way. Reports ns per lookup, the load factor, and
+// the bytes per entry counted by the table's allocator.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t allocated;
+
+static void *counting_alloc(void *ctx, size_t size, size_t alignment) {
+  (void)ctx;
+  allocated += size;
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  allocated -= size;
+  free(ptr);
+}
+
+// Returns whether every lookup gave the right answer.
+static bool measure(const char *name, const HashTable *table,
+                    const uint64_t *keys, const size_t *order, size_t n) {
+  size_t found = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    found += hash_table_lookup(table, &keys[order[i]]) != NULL;
+  double hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = keys[order[i]] + 1;
+    found -= hash_table_lookup(table, &key) != NULL;
+  }
+  double miss_ns = (now_ns() - start) / n;
+  printf("%-8s %10.1f %10.1f %10.2f %10.1f\n", name, hit_ns, miss_ns,
+         (double)n / hash_table_capacity(table), (double)allocated / n);
+  return found == n;
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 22;
+  if (log2_entries < 10 || log2_entries > 26) {
+    fprintf(stderr, "log2_entries must be between 10 and 26\n");
+    return 1;
+  }
+  size_t n = (size_t)1 << log2_entries;
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  size_t *order = malloc(sizeof(size_t) * n);
+  if (!keys || !order) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  // Even keys, so that adding one gives a key that is absent.
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = next_random() & ~(uint64_t)1;
+    order[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    size_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  printf("%zu entries of 16 bytes, ns/lookup\n", n);
+  printf("%-8s %10s %10s %10s %10s\n", "table", "hit", "miss", "load",
+         "bytes/ent");
+  context_allocator counting = {counting_alloc, counting_free, NULL, NULL};
+  type_handler key_handler = {.equal = equal_u64,
+                              .hash_with_seed = hash_table_hash_u64};
+  const hash_table_engine engines[] = {HASH_TABLE_ENGINE_SWISS,
+                                       HASH_TABLE_ENGINE_ROBIN_HOOD};
+  const char *names[] = {"swiss", "robin"};
+  for (int e = 0; e < 2; e++) {
+    hash_table_options options = {.engine = engines[e],
+                                  .key_size = sizeof(uint64_t),
+                                  .value_size = sizeof(uint64_t),
+                                  .allocator = &counting};
+    HashTable *table = hash_table_create_with_options(
+        key_handler, (type_handler){0}, NULL, &options);
+    if (!table) {
+      fprintf(stderr, "out of memory\n");
+      return 1;
+    }
+    for (size_t i = 0; i < n; i++)
+      hash_table_insert(table, &keys[i], &keys[i]);
+    bool ok = measure(names[e], table, keys, order, n);
+    if (engines[e] == HASH_TABLE_ENGINE_ROBIN_HOOD)
+      ok = ok && hash_table_freeze(table) &&
+           measure("frozen", table, keys, order, n);
+    hash_table_destroy(table);
+    if (!ok) {
+      fprintf(stderr, "lookups failed\n");
+      return 1;
+    }
+  }
+
+  free(keys);
+  free(order);
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Cost of the built-in hashes against the byte-at-a-time hashes they
+// replace, alone and inside a table.
+//
+// Usage: bench_hash [log2_entries]
+//
+// The first part hashes a buffer of keys of each length and reports
+// nanoseconds per key. The second fills a SWISS table of 2^log2_entries
+// (default 2^20) 24-byte inline keys, hashed by each function in turn, and
+// times looking every key up in a shuffled order.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KEY_SIZE 24
+#define HASH_KEYS 4096
+#define HASH_ROUNDS 64
+
+static uint64_t djb2(const void *key, size_t size, uint64_t seed) {
+  const unsigned char *p = key;
+  uint64_t hash = 5381 ^ seed;
+  for (size_t i = 0; i < size; i++)
+    hash = ((hash << 5) + hash) ^ p[i];
+  return hash;
+}
+
+static uint64_t fnv1a(const void *key, size_t size, uint64_t seed) {
+  const unsigned char *p = key;
+  uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+static const struct {
+  const char *name;
+  seeded_hash_function hash;
+} hashes[] = {
+    {"djb2", djb2},
+    {"fnv1a", fnv1a},
+    {"hash_table_hash_bytes", hash_table_hash_bytes},
+    {"hash_table_hash_crc32c", hash_table_hash_crc32c},
+};
+#define HASH_COUNT (sizeof(hashes) / sizeof(hashes[0]))
+
+// The plain hash handlers the table mixes with ht_mix_hash(), as a user
+// handler wrapping djb2 or fnv1a would be.
+static uint64_t djb2_key(const void *key) { return djb2(key, KEY_SIZE, 0); }
+static uint64_t fnv1a_key(const void *key) { return fnv1a(key, KEY_SIZE, 0); }
+
+static bool equal_key(const void *key1, const void *key2) {
+  return memcmp(key1, key2, KEY_SIZE) == 0;
+}
+
+static void bench_lengths(void) {
+  static const size_t lengths[] = {8, 16, 24, 64, 256, 1024};
+  size_t max_length = 1024;
+  unsigned char *keys = malloc(HASH_KEYS * max_length);
+  if (!keys) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < HASH_KEYS * max_length; i++)
+    keys[i] = (unsigned char)next_random();
+
+  printf("%-22s", "ns per key");
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    printf(" %7zuB", lengths[l]);
+  printf("\n");
+  uint64_t sink = 0;
+  for (size_t h = 0; h < HASH_COUNT; h++) {
+    printf("%-22s", hashes[h].name);
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+      size_t length = lengths[l];
+      // Fewer rounds for long keys keep every cell about equally long.
+      size_t rounds = HASH_ROUNDS * 64 / (length < 64 ? 64 : length) + 1;
+      double start = now_ns();
+      for (size_t r = 0; r < rounds; r++)
+        for (size_t i = 0; i < HASH_KEYS; i++)
+          sink += hashes[h].hash(keys + i * max_length, length, r);
+      printf(" %8.2f", (now_ns() - start) / (rounds * HASH_KEYS));
+    }
+    printf("\n");
+  }
+  free(keys);
+  if (sink == 42)
+    printf("\n");
+}
+
+static void bench_table(size_t n) {
+  unsigned char *keys = malloc(n * KEY_SIZE);
+  size_t *order = malloc(sizeof(size_t) * n);
+  if (!keys || !order) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < n * KEY_SIZE; i++)
+    keys[i] = (unsigned char)next_random();
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  type_handler handlers[HASH_COUNT] = {
+      {.equal = equal_key, .hash = djb2_key},
+      {.equal = equal_key, .hash = fnv1a_key},
+      {.equal = equal_key, .hash_with_seed = hash_table_hash_bytes},
+      {.equal = equal_key, .hash_with_seed = hash_table_hash_crc32c},
+  };
+  hash_table_options options = {.engine = HASH_TABLE_ENGINE_SWISS,
+                                .initial_capacity = n,
+                                .key_size = KEY_SIZE,
+                                .value_size = sizeof(uint64_t),
+                                .seed = hash_table_random_seed()};
+  printf("\n%zu %d-byte keys, ns per lookup\n", n, KEY_SIZE);
+  for (size_t h = 0; h < HASH_COUNT; h++) {
+    HashTable *table = hash_table_create_with_options(
+        handlers[h], (type_handler){0}, NULL, &options);
+    for (size_t i = 0; table && i < n; i++) {
+      uint64_t value = i;
+      if (!hash_table_insert(table, keys + i * KEY_SIZE, &value)) {
+        hash_table_destroy(table);
+        table = NULL;
+      }
+    }
+    if (!table) {
+      fprintf(stderr, "failed to build the table\n");
+      exit(1);
+    }
+    size_t found = 0;
+    double start = now_ns();
+    for (size_t i = 0; i < n; i++)
+      found += hash_table_lookup(table, keys + order[i] * KEY_SIZE) != NULL;
+    double ns = (now_ns() - start) / n;
+    printf("%-22s %8.2f%s\n", hashes[h].name, ns,
+           found == n ? "" : "  (keys missing)");
+    hash_table_destroy(table);
+  }
+  free(keys);
+  free(order);
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 20;
+  if (log2_entries < 10 || log2_entries > 26) {
+    fprintf(stderr, "log2_entries must be between 10 and 26\n");
+    return 1;
+  }
+  bench_lengths();
+  bench_table((size_t)1 << log2_entries);
+  return 0;
+}
@@ -0,0 +1,157 @@
+// A uint64_t -> uint32_t ID map generated by HT_DEFINE_INT_MAP() against
+// the generic HashTable and HT_DEFINE() with the same key and value types.
+//
+// Usage: bench_intmap [log2_slots]
+//
+// Inserts 0.8 * 2^log2_slots (default 2^20) random keys, the most the
+// integer map holds in 2^log2_slots slots, then looks every key up in a
+// random order, then looks up as many absent keys. Reports ns per
+// operation and the bytes the map takes per entry, against the 12 bytes of
+// payload. The generic table's bytes are counted by its allocator; the
+// HT_DEFINE() map has the same layout.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include "hashtable_intmap.h"
+#include "hashtable_typed.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline uint64_t hash_u64(const uint64_t *key) { return *key; }
+
+static inline bool eq_u64(const uint64_t *a, const uint64_t *b) {
+  return *a == *b;
+}
+
+HT_DEFINE(typed_map, uint64_t, uint32_t, hash_u64, eq_u64)
+HT_DEFINE_INT_MAP(id_map, uint64_t, uint32_t)
+
+static uint64_t generic_hash_u64(const void *key) { return hash_u64(key); }
+static bool generic_eq_u64(const void *a, const void *b) {
+  return eq_u64(a, b);
+}
+
+static size_t allocated;
+
+static void *counting_alloc(void *ctx, size_t size, size_t alignment) {
+  (void)ctx;
+  allocated += size;
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  allocated -= size;
+  free(ptr);
+}
+
+static void report(const char *impl, double insert_ns, double hit_ns,
+                   double miss_ns, size_t bytes, size_t n) {
+  if (bytes)
+    printf("%-8s %10.1f %10.1f %10.1f %10.1f\n", impl, insert_ns, hit_ns,
+           miss_ns, (double)bytes / n);
+  else
+    printf("%-8s %10.1f %10.1f %10.1f %10s\n", impl, insert_ns, hit_ns,
+           miss_ns, "-");
+}
+
+int main(int argc, char **argv) {
+  int log2_slots = argc > 1 ? atoi(argv[1]) : 20;
+  if (log2_slots < 10 || log2_slots > 28) {
+    fprintf(stderr, "log2_slots must be between 10 and 28\n");
+    return 1;
+  }
+  size_t n = ((size_t)1 << log2_slots) / 5 * 4;
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  size_t *order = malloc(sizeof(size_t) * n);
+  if (!keys || !order) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  // Even keys, so that adding one gives a key that is absent.
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = next_random() & ~(uint64_t)1;
+    order[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    size_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  printf("%zu entries of 12 bytes, ns/op\n", n);
+  printf("%-8s %10s %10s %10s %10s\n", "map", "insert", "hit", "miss",
+         "bytes/ent");
+  double start, insert_ns, hit_ns, miss_ns;
+  uint64_t sum = 0;
+
+  context_allocator counting = {counting_alloc, counting_free, NULL, NULL};
+  type_handler key_handler = {.equal = generic_eq_u64,
+                              .hash = generic_hash_u64};
+  hash_table_options options = {.key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint32_t),
+                                .allocator = &counting};
+  HashTable *generic = hash_table_create_with_options(
+      key_handler, (type_handler){0}, NULL, &options);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    uint32_t value = (uint32_t)i;
+    hash_table_insert(generic, &keys[i], &value);
+  }
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += *(uint32_t *)hash_table_lookup(generic, &keys[order[i]]);
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = keys[order[i]] + 1;
+    sum += hash_table_lookup(generic, &key) != NULL;
+  }
+  miss_ns = (now_ns() - start) / n;
+  report("generic", insert_ns, hit_ns, miss_ns, allocated, n);
+  hash_table_destroy(generic);
+
+  typed_map *typed = typed_map_create(0);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    typed_map_insert(typed, keys[i], (uint32_t)i);
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= *typed_map_lookup(typed, keys[order[i]]);
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= typed_map_lookup(typed, keys[order[i]] + 1) != NULL;
+  miss_ns = (now_ns() - start) / n;
+  report("typed", insert_ns, hit_ns, miss_ns, 0, n);
+  typed_map_destroy(typed);
+
+  id_map *ids = id_map_create(0);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    id_map_insert(ids, keys[i], (uint32_t)i);
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += *id_map_lookup(ids, keys[order[i]]);
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += id_map_lookup(ids, keys[order[i]] + 1) != NULL;
+  miss_ns = (now_ns() - start) / n;
+  size_t bytes = sizeof(id_map) + id_map_capacity(ids) *
+                                      (sizeof(uint64_t) + sizeof(uint32_t));
+  report("intmap", insert_ns, hit_ns, miss_ns, bytes, n);
+  id_map_destroy(ids);
+
+  free(keys);
+  free(order);
+  if (sum != (uint64_t)n * (n - 1) / 2) {
+    fprintf(stderr, "maps disagree\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,117 @@
+// Interleaved entries against separate_values, for uint64_t keys and
+// inline values of a few sizes, on lookups that mostly miss.
+//
+// Usage: bench_layout [log2_capacity]
+//
+// Each run fills a table of 2^log2_capacity slots (default 2^22, well past
+// the last-level cache for the larger values) to a load factor of 0.75 and
+// times lookups of keys in a shuffled order, where the given share of them
+// are absent. Misses only touch the key side of the slot array, so they
+// gain the most from keeping the values apart.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOAD_FACTOR 0.75
+
+static uint64_t hash_u64(const void *key) { return *(const uint64_t *)key; }
+
+static double time_lookups(const HashTable *table, const uint64_t *keys,
+                           size_t n, size_t *found) {
+  double start = now_ns();
+  size_t hits = 0;
+  for (size_t i = 0; i < n; i++)
+    hits += hash_table_lookup(table, &keys[i]) != NULL;
+  *found = hits;
+  return (now_ns() - start) / n;
+}
+
+int main(int argc, char **argv) {
+  int log2_capacity = argc > 1 ? atoi(argv[1]) : 22;
+  if (log2_capacity < 10 || log2_capacity > 28) {
+    fprintf(stderr, "log2_capacity must be between 10 and 28\n");
+    return 1;
+  }
+  size_t capacity = (size_t)1 << log2_capacity;
+  size_t n = (size_t)(capacity * LOAD_FACTOR);
+  const size_t value_sizes[] = {8, 24, 56};
+  const double miss_shares[] = {0.5, 0.9, 1.0};
+  const struct {
+    const char *name;
+    hash_table_engine engine;
+  } engines[] = {{"linear", HASH_TABLE_ENGINE_LINEAR},
+                 {"swiss", HASH_TABLE_ENGINE_SWISS},
+                 {"robin", HASH_TABLE_ENGINE_ROBIN_HOOD}};
+
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  uint64_t *probes = malloc(sizeof(uint64_t) * n);
+  unsigned char *value = calloc(1, 64);
+  if (!keys || !probes || !value) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  // Even numbers are inserted, odd numbers never are.
+  for (size_t i = 0; i < n; i++)
+    keys[i] = next_random() << 1;
+
+  type_handler key_handler = {.equal = equal_u64, .hash = hash_u64};
+  printf("capacity %zu slots, load %.2f, ns per lookup\n", capacity,
+         LOAD_FACTOR);
+  printf("%-8s %6s %-12s", "engine", "value", "layout");
+  for (size_t m = 0; m < sizeof(miss_shares) / sizeof(miss_shares[0]); m++)
+    printf("   %3.0f%% miss", miss_shares[m] * 100);
+  printf("\n");
+
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    for (size_t v = 0; v < sizeof(value_sizes) / sizeof(value_sizes[0]);
+         v++) {
+      for (int separate = 0; separate <= 1; separate++) {
+        hash_table_options options = {.engine = engines[e].engine,
+                                      .max_load_factor = 0.9,
+                                      .key_size = sizeof(uint64_t),
+                                      .value_size = value_sizes[v],
+                                      .initial_capacity = n,
+                                      .separate_values = separate};
+        HashTable *table = hash_table_create_with_options(
+            key_handler, (type_handler){0}, NULL, &options);
+        for (size_t i = 0; table && i < n; i++) {
+          if (!hash_table_insert(table, &keys[i], value)) {
+            hash_table_destroy(table);
+            table = NULL;
+          }
+        }
+        if (!table) {
+          fprintf(stderr, "failed to build the table\n");
+          return 1;
+        }
+        printf("%-8s %6zu %-12s", engines[e].name, value_sizes[v],
+               separate ? "separate" : "interleaved");
+        for (size_t m = 0; m < sizeof(miss_shares) / sizeof(miss_shares[0]);
+             m++) {
+          size_t misses = 0;
+          for (size_t i = 0; i < n; i++) {
+            bool miss = next_random() % 1000 < miss_shares[m] * 1000;
+            probes[i] = keys[next_random() % n] | miss;
+            misses += miss;
+          }
+          size_t found;
+          double ns = time_lookups(table, probes, n, &found);
+          if (found != n - misses) {
+            fprintf(stderr, "lookups found %zu of %zu keys\n", found,
+                    n - misses);
+            return 1;
+          }
+          printf(" %12.1f", ns);
+        }
+        printf("\n");
+        hash_table_destroy(table);
+      }
+    }
+  }
+  free(keys);
+  free(probes);
+  free(value);
+  return 0;
+}
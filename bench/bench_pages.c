@@ -0,0 +1,111 @@
+// Random lookups in a large table whose slot arrays come from malloc()
+// against the same table on huge pages from hash_pages_allocator().
+//
+// Usage: bench_pages [log2_capacity] [2mb|1gb]
+//
+// Fills a uint64_t -> uint64_t table of 2^log2_capacity slots (default
+// 2^24, 256 MiB of entries) to a load factor of 0.75, then times lookups
+// of every key in a shuffled order, where nearly every lookup misses the
+// TLB with 4 KiB pages. By default the huge pages are transparent ones;
+// 2mb or 1gb ask for pages from the reserved pool instead, falling back
+// to transparent ones. The AnonHugePages line of /proc/self/smaps_rollup
+// shows how much of the table the kernel really backed with huge pages.
+
+#define _POSIX_C_SOURCE 200809L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t hash_u64(const void *key) { return *(const uint64_t *)key; }
+
+// Kilobytes of anonymous memory on transparent huge pages, or -1.
+static long anon_huge_kb(void) {
+  FILE *file = fopen("/proc/self/smaps_rollup", "r");
+  if (!file)
+    return -1;
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (strncmp(line, "AnonHugePages:", 14) == 0)
+      kb = atol(line + 14);
+  }
+  fclose(file);
+  return kb;
+}
+
+static void run(const char *name, const context_allocator *allocator,
+                const uint64_t *keys, const uint64_t *order, size_t n) {
+  type_handler key_handler = {.equal = equal_u64, .hash = hash_u64};
+  hash_table_options options = {.key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint64_t),
+                                .initial_capacity = n,
+                                .allocator = allocator};
+  long huge_before = anon_huge_kb();
+  HashTable *table = hash_table_create_with_options(
+      key_handler, (type_handler){0}, NULL, &options);
+  for (size_t i = 0; table && i < n; i++) {
+    if (!hash_table_insert(table, (void *)&keys[i], (void *)&keys[i])) {
+      hash_table_destroy(table);
+      table = NULL;
+    }
+  }
+  if (!table) {
+    fprintf(stderr, "%s: failed to build the table\n", name);
+    exit(1);
+  }
+  size_t found = 0;
+  double start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    found += hash_table_lookup(table, &order[i]) != NULL;
+  double ns = (now_ns() - start) / n;
+  long huge_after = anon_huge_kb();
+  printf("%-12s %10.1f %14ld%s\n", name, ns,
+         huge_before < 0 ? -1 : (huge_after - huge_before) / 1024,
+         found == n ? "" : "  (keys missing)");
+  hash_table_destroy(table);
+}
+
+int main(int argc, char **argv) {
+  int log2_capacity = argc > 1 ? atoi(argv[1]) : 24;
+  if (log2_capacity < 16 || log2_capacity > 32) {
+    fprintf(stderr, "log2_capacity must be between 16 and 32\n");
+    return 1;
+  }
+  hash_pages_options page_options = {0};
+  if (argc > 2 && strcmp(argv[2], "2mb") == 0)
+    page_options.page_size = HASH_PAGES_HUGE_2MB;
+  else if (argc > 2 && strcmp(argv[2], "1gb") == 0)
+    page_options.page_size = HASH_PAGES_HUGE_1GB;
+
+  size_t n = ((size_t)1 << log2_capacity) / 4 * 3;
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  uint64_t *order = malloc(sizeof(uint64_t) * n);
+  hash_pages *pages = hash_pages_create(&page_options);
+  if (!keys || !order || !pages) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++)
+    keys[i] = order[i] = next_random();
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    uint64_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  printf("%zu entries\n%-12s %10s %14s\n", n, "allocator", "ns/lookup",
+         "THP MiB added");
+  context_allocator huge = hash_pages_allocator(pages);
+  run("malloc", NULL, keys, order, n);
+  run("hash_pages", &huge, keys, order, n);
+  size_t fallbacks;
+  hash_pages_usage(pages, NULL, &fallbacks);
+  if (fallbacks)
+    printf("%zu mappings fell back to transparent huge pages\n", fallbacks);
+  hash_pages_destroy(pages);
+  free(keys);
+  free(order);
+  return 0;
+}
@@ -0,0 +1,85 @@
+// Parallel resize and bulk build against their single-threaded versions,
+// for uint64_t keys and values stored inline.
+//
+// Usage: bench_parallel [log2_entries]
+//
+// For each engine and thread count, times hash_table_build_parallel() on
+// 2^log2_entries (default 2^22) random pairs, then one resize of the
+// built table to twice its capacity with resize_threads set to the same
+// count. One thread is the serial code path. The speedup is bounded by the
+// number of cores and by memory bandwidth, since both mostly move data.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 22;
+  if (log2_entries < 16 || log2_entries > 28) {
+    fprintf(stderr, "log2_entries must be between 16 and 28\n");
+    return 1;
+  }
+  size_t n = (size_t)1 << log2_entries;
+  const size_t thread_counts[] = {1, 2, 4, 8};
+  const struct {
+    const char *name;
+    hash_table_engine engine;
+  } engines[] = {{"linear", HASH_TABLE_ENGINE_LINEAR},
+                 {"swiss", HASH_TABLE_ENGINE_SWISS},
+                 {"robin", HASH_TABLE_ENGINE_ROBIN_HOOD}};
+
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  const void **key_ptrs = malloc(sizeof(void *) * n);
+  if (!keys || !key_ptrs) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = next_random();
+    key_ptrs[i] = &keys[i];
+  }
+
+  type_handler key_handler = {.equal = equal_u64,
+                              .hash_with_seed = hash_table_hash_u64};
+  printf("%zu entries, ms\n", n);
+  printf("%-8s %7s %10s %10s\n", "engine", "threads", "build", "resize");
+  for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]);
+         t++) {
+      hash_table_options options = {.engine = engines[e].engine,
+                                    .key_size = sizeof(uint64_t),
+                                    .value_size = sizeof(uint64_t),
+                                    .resize_threads = thread_counts[t]};
+      double start = now_ns() / 1e6;
+      // Each key is its own value.
+      HashTable *table = hash_table_build_parallel(
+          key_handler, (type_handler){0}, &options, key_ptrs, key_ptrs, n,
+          thread_counts[t]);
+      double build = now_ns() / 1e6 - start;
+      if (!table || hash_table_count(table) != n) {
+        fprintf(stderr, "failed to build the table\n");
+        return 1;
+      }
+      start = now_ns() / 1e6;
+      if (!hash_table_reserve(table, hash_table_capacity(table))) {
+        fprintf(stderr, "failed to resize the table\n");
+        return 1;
+      }
+      double resize = now_ns() / 1e6 - start;
+      for (size_t i = 0; i < n; i += n / 1024) {
+        const uint64_t *value = hash_table_lookup(table, &keys[i]);
+        if (!value || *value != keys[i]) {
+          fprintf(stderr, "lookup after resize failed\n");
+          return 1;
+        }
+      }
+      printf("%-8s %7zu %10.1f %10.1f\n", engines[e].name, thread_counts[t],
+             build, resize);
+      hash_table_destroy(table);
+    }
+  }
+  free(keys);
+  free(key_ptrs);
+  return 0;
+}
@@ -0,0 +1,146 @@
+// Multi-threaded throughput of ShardedHashTable against a single HashTable
+// behind one global mutex.
+//
+// Usage: bench_sharded [log2_entries] [seconds_per_run]
+//
+// Prefills 2^log2_entries (default 2^20) inline uint64_t keys, then runs a
+// mixed workload of 90% lookups, 5% inserts and 5% deletes over twice that
+// key space from 1 to 64 threads and reports millions of operations per
+// second.
+
+#define _POSIX_C_SOURCE 200809L
+#include "bench_common.h"
+#include "sharded_hashtable.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t hash_u64(const void *key) { return *(const uint64_t *)key; }
+
+struct locked_table {
+  pthread_mutex_t lock;
+  HashTable *table;
+};
+
+struct worker {
+  pthread_t thread;
+  uint64_t rng_state;
+  uint64_t key_space;
+  uint64_t ops;
+  ShardedHashTable *sharded;    // or
+  struct locked_table *locked;
+};
+
+static atomic_bool running;
+static atomic_bool started;
+
+static void *run_worker(void *arg) {
+  struct worker *w = arg;
+  while (!atomic_load_explicit(&started, memory_order_acquire))
+    ;
+  uint64_t ops = 0;
+  while (atomic_load_explicit(&running, memory_order_relaxed)) {
+    for (int i = 0; i < 256; i++) {
+      uint64_t r = xorshift64(&w->rng_state);
+      uint64_t key = (r >> 8) % w->key_space;
+      unsigned op = r & 0xFF; // < 230 lookup, < 243 insert, else delete
+      if (w->sharded) {
+        if (op < 230) {
+          sharded_hash_table_lookup(w->sharded, &key);
+        } else if (op < 243) {
+          sharded_hash_table_insert(w->sharded, &key, &key);
+        } else {
+          sharded_hash_table_delete(w->sharded, &key);
+        }
+      } else {
+        pthread_mutex_lock(&w->locked->lock);
+        if (op < 230) {
+          hash_table_lookup(w->locked->table, &key);
+        } else if (op < 243) {
+          hash_table_insert(w->locked->table, &key, &key);
+        } else {
+          hash_table_delete(w->locked->table, &key);
+        }
+        pthread_mutex_unlock(&w->locked->lock);
+      }
+    }
+    ops += 256;
+  }
+  w->ops = ops;
+  return NULL;
+}
+
+static double run(int threads, double seconds, uint64_t key_space,
+                  ShardedHashTable *sharded, struct locked_table *locked) {
+  struct worker *workers = calloc(threads, sizeof(struct worker));
+  if (!workers)
+    return 0;
+  atomic_store(&running, true);
+  atomic_store(&started, false);
+  for (int i = 0; i < threads; i++) {
+    workers[i].rng_state = 0x9E3779B97F4A7C15ULL * (i + 1);
+    workers[i].key_space = key_space;
+    workers[i].sharded = sharded;
+    workers[i].locked = locked;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  double start = now_ns() / 1e9;
+  atomic_store_explicit(&started, true, memory_order_release);
+  struct timespec duration = {(time_t)seconds,
+                              (long)((seconds - (time_t)seconds) * 1e9)};
+  nanosleep(&duration, NULL);
+  atomic_store(&running, false);
+  uint64_t ops = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    ops += workers[i].ops;
+  }
+  double elapsed = now_ns() / 1e9 - start;
+  free(workers);
+  return ops / elapsed / 1e6;
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 20;
+  double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+  if (log2_entries < 10 || log2_entries > 28 || seconds <= 0) {
+    fprintf(stderr, "usage: bench_sharded [log2_entries 10-28] [seconds]\n");
+    return 1;
+  }
+  uint64_t n = (uint64_t)1 << log2_entries;
+  type_handler key_handler = {.equal = equal_u64, .hash = hash_u64};
+  type_handler value_handler = {0};
+  hash_table_options table_options = {.key_size = sizeof(uint64_t),
+                                      .value_size = sizeof(uint64_t),
+                                      .initial_capacity = 2 * n};
+
+  sharded_hash_table_options sharded_options = {
+      .shard_count = 64, .table_options = table_options};
+  ShardedHashTable *sharded =
+      sharded_hash_table_create(key_handler, value_handler, &sharded_options);
+  struct locked_table locked = {
+      PTHREAD_MUTEX_INITIALIZER,
+      hash_table_create_with_options(key_handler, value_handler, NULL,
+                                     &table_options)};
+  if (!sharded || !locked.table) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (uint64_t key = 0; key < 2 * n; key += 2) {
+    sharded_hash_table_insert(sharded, &key, &key);
+    hash_table_insert(locked.table, &key, &key);
+  }
+
+  printf("%llu prefilled entries, 64 shards, Mops/s\n", (unsigned long long)n);
+  printf("%8s %12s %12s\n", "threads", "mutex", "sharded");
+  for (int threads = 1; threads <= 64; threads *= 2) {
+    double mutex_mops = run(threads, seconds, 2 * n, NULL, &locked);
+    double sharded_mops = run(threads, seconds, 2 * n, sharded, NULL);
+    printf("%8d %12.2f %12.2f\n", threads, mutex_mops, sharded_mops);
+  }
+
+  sharded_hash_table_destroy(sharded);
+  hash_table_destroy(locked.table);
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Warm start from a snapshot against rebuilding the table by inserting
+// every entry, for a uint64_t -> uint64_t table.
+//
+// Usage: bench_snapshot [log2_entries] [path]
+//
+// Builds a table of 2^log2_entries (default 2^22) entries, saves it to
+// path (default /tmp/bench_snapshot.bin), then times opening the snapshot
+// and looking every key up twice in a random order: the first pass pays
+// for the page faults that bring the mapping in, the second runs on
+// resident pages. The file is usually still in the page cache, so the
+// first pass shows the fault cost rather than the cost of reading disk.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t hash_u64(const void *key) { return *(const uint64_t *)key; }
+
+static bool eq_u64(const void *a, const void *b) {
+  return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+static double elapsed_ms(double start) { return (now_ns() - start) / 1e6; }
+
+// Looks up every key in order; returns how many were found.
+static size_t lookup_all(const HashTable *table, const uint64_t *keys,
+                         const size_t *order, size_t n) {
+  size_t found = 0;
+  for (size_t i = 0; i < n; i++)
+    found += hash_table_lookup(table, &keys[order[i]]) != NULL;
+  return found;
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 22;
+  const char *path = argc > 2 ? argv[2] : "/tmp/bench_snapshot.bin";
+  if (log2_entries < 10 || log2_entries > 28) {
+    fprintf(stderr, "log2_entries must be between 10 and 28\n");
+    return 1;
+  }
+  size_t n = (size_t)1 << log2_entries;
+
+  uint64_t *keys = malloc(sizeof(uint64_t) * n);
+  size_t *order = malloc(sizeof(size_t) * n);
+  if (!keys || !order) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = next_random();
+    order[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  type_handler key_handler = {.equal = eq_u64, .hash = hash_u64};
+  hash_table_options options = {.key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint64_t)};
+  printf("%zu entries, ms\n", n);
+
+  double start = now_ns();
+  HashTable *table = hash_table_create_with_options(
+      key_handler, (type_handler){0}, NULL, &options);
+  for (size_t i = 0; table && i < n; i++) {
+    if (!hash_table_insert(table, &keys[i], &keys[i])) {
+      hash_table_destroy(table);
+      table = NULL;
+    }
+  }
+  if (!table) {
+    fprintf(stderr, "failed to build the table\n");
+    return 1;
+  }
+  printf("%-24s %10.1f\n", "rebuild by inserting", elapsed_ms(start));
+
+  start = now_ns();
+  if (!hash_table_save(table, path)) {
+    fprintf(stderr, "failed to save %s\n", path);
+    return 1;
+  }
+  printf("%-24s %10.1f\n", "save", elapsed_ms(start));
+  hash_table_destroy(table);
+
+  start = now_ns();
+  HashTable *mapped = hash_table_open_mmap(path, key_handler, false);
+  if (!mapped) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return 1;
+  }
+  printf("%-24s %10.1f\n", "open", elapsed_ms(start));
+  start = now_ns();
+  size_t found = lookup_all(mapped, keys, order, n);
+  printf("%-24s %10.1f\n", "first lookup pass", elapsed_ms(start));
+  start = now_ns();
+  found += lookup_all(mapped, keys, order, n);
+  printf("%-24s %10.1f\n", "second lookup pass", elapsed_ms(start));
+  hash_table_destroy(mapped);
+  remove(path);
+
+  free(keys);
+  free(order);
+  return found == 2 * n ? 0 : 1;
+}
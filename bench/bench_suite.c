@@ -0,0 +1,560 @@
+// Benchmark matrix over workloads, key types, table sizes, load factors and
+// engines, for spotting regressions and comparing engines.
+//
+// Usage: bench_suite [--json] [--quick] [--engine NAME] [--key NAME]
+//                    [--llc-kb N]
+//
+// Workloads, each reported per operation:
+//   insert  inserts n keys into a table sized for them up front
+//   hit     looks up every present key in a random order
+//   miss    looks up as many absent keys
+//   churn   deletes the oldest key and inserts a new one, n times, at a
+//           steady size (one op is the delete and insert pair)
+//   delete  deletes every key in a random order
+//   resize  inserts n keys into a table that starts small and grows
+//
+// Key types: u64 (inline), user_key (the demo's struct, inline) and str
+// (variable-length strings of 8 to 39 bytes, stored as pointers to
+// copies). Values are inline uint64_t.
+//
+// Sizes are cache tiers: a table that fits L1, L2, half the last-level
+// cache, and 10x the last-level cache, detected with sysconf() or set with
+// --llc-kb. Each is run at load factors 0.5, 0.75 and 0.875. --quick keeps
+// only load factor 0.75 and skips the 10x LLC tier.
+//
+// Besides ns/op, cycles and cache misses per op are read from perf
+// counters where the kernel allows it, and bytes/entry counts everything
+// the table allocated, including key copies, divided by its entries.
+// --json prints one JSON document instead of a table, for diffing runs.
+
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// Workloads on small tables repeat until they have done this many ops.
+#define MIN_OPS (1 << 20)
+
+typedef struct {
+  int id;
+  char name[32];
+} user_key;
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t hash_u64(const void *key) {
+  return mix(*(const uint64_t *)key);
+}
+
+// The demo's hash and comparison.
+static uint64_t hash_user_key(const void *key) {
+  const user_key *uk = key;
+  uint64_t hash = 5381;
+  hash = ((hash << 5) + hash) ^ uk->id;
+  for (const char *p = uk->name; *p; p++)
+    hash = ((hash << 5) + hash) ^ *p;
+  return hash;
+}
+
+static bool equal_user_key(const void *key1, const void *key2) {
+  const user_key *uk1 = key1;
+  const user_key *uk2 = key2;
+  return uk1->id == uk2->id && strcmp(uk1->name, uk2->name) == 0;
+}
+
+// FNV-1a.
+static uint64_t hash_string(const void *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const unsigned char *p = key; *p; p++) {
+    hash ^= *p;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static bool equal_string(const void *key1, const void *key2) {
+  return strcmp(key1, key2) == 0;
+}
+
+static void *copy_string(const void *original,
+                         const context_allocator *allocator) {
+  size_t size = strlen(original) + 1;
+  char *copy = allocator->alloc(allocator->ctx, size, 1);
+  if (copy)
+    memcpy(copy, original, size);
+  return copy;
+}
+
+static void destroy_string(void *data, const context_allocator *allocator) {
+  allocator->free(allocator->ctx, data, strlen(data) + 1);
+}
+
+// Key number i. Numbers are mixed first so that neighbouring keys do not
+// share a prefix.
+static void make_u64(void *out, uint64_t i) {
+  uint64_t key = mix(i);
+  memcpy(out, &key, sizeof(key));
+}
+
+static void make_user_key(void *out, uint64_t i) {
+  user_key key = {.id = (int)i};
+  snprintf(key.name, sizeof(key.name), "user-%016llx",
+           (unsigned long long)mix(i));
+  memcpy(out, &key, sizeof(key));
+}
+
+static char *make_string(uint64_t i) {
+  char buffer[40];
+  int length = snprintf(buffer, sizeof(buffer), "%llx",
+                        (unsigned long long)mix(i) & 0xffffffff);
+  int target = 8 + (int)(i % 32);
+  for (; length < target; length++)
+    buffer[length] = 'a' + (char)(length % 26);
+  buffer[length] = '\0';
+  return strdup(buffer);
+}
+
+struct key_type {
+  const char *name;
+  size_t key_size;       // inline size, or 0 for copied string keys
+  size_t bytes_per_slot; // rough footprint per slot, for sizing tiers
+  type_handler handler;
+  void (*make)(void *out, uint64_t i); // inline keys only
+};
+
+static const struct key_type key_types[] = {
+    {"u64", sizeof(uint64_t), 17, {.hash = hash_u64, .equal = equal_u64},
+     make_u64},
+    {"user_key",
+     sizeof(user_key),
+     49,
+     {.hash = hash_user_key, .equal = equal_user_key},
+     make_user_key},
+    {"str",
+     0,
+     48,
+     {.hash = hash_string,
+      .equal = equal_string,
+      .copy_with_allocator = copy_string,
+      .destroy_with_allocator = destroy_string},
+     NULL},
+};
+
+static const struct {
+  const char *name;
+  hash_table_engine engine;
+} engines[] = {{"linear", HASH_TABLE_ENGINE_LINEAR},
+               {"swiss", HASH_TABLE_ENGINE_SWISS},
+               {"robin", HASH_TABLE_ENGINE_ROBIN_HOOD}};
+
+// Keys are numbered: [0, 2n) may be inserted (the second half by churn),
+// [2n, 3n) never are.
+struct keys {
+  const struct key_type *type;
+  size_t n;
+  unsigned char *inline_keys;
+  char **strings;
+};
+
+static bool keys_init(struct keys *keys, const struct key_type *type,
+                      size_t n) {
+  keys->type = type;
+  keys->n = n;
+  keys->inline_keys = NULL;
+  keys->strings = NULL;
+  if (type->key_size) {
+    keys->inline_keys = malloc(type->key_size * 3 * n);
+    if (!keys->inline_keys)
+      return false;
+    for (size_t i = 0; i < 3 * n; i++)
+      type->make(keys->inline_keys + i * type->key_size, i);
+  } else {
+    keys->strings = calloc(3 * n, sizeof(char *));
+    if (!keys->strings)
+      return false;
+    for (size_t i = 0; i < 3 * n; i++) {
+      if (!(keys->strings[i] = make_string(i)))
+        return false;
+    }
+  }
+  return true;
+}
+
+static void keys_free(struct keys *keys) {
+  if (keys->strings) {
+    for (size_t i = 0; i < 3 * keys->n; i++)
+      free(keys->strings[i]);
+  }
+  free(keys->strings);
+  free(keys->inline_keys);
+}
+
+static void *key_at(const struct keys *keys, size_t i) {
+  if (keys->strings)
+    return keys->strings[i];
+  return keys->inline_keys + i * keys->type->key_size;
+}
+
+// Allocator that keeps a running total of the bytes it has handed out.
+static void *counting_alloc(void *ctx, size_t size, size_t alignment) {
+  *(size_t *)ctx += size;
+  if (alignment <= _Alignof(max_align_t))
+    return malloc(size);
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size) {
+  *(size_t *)ctx -= size;
+  free(ptr);
+}
+
+// Cycle and cache miss counters for the whole process, read as one group.
+// Unavailable without a PMU or when perf_event_paranoid forbids it.
+static int perf_fd = -1;
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void perf_init(void) {
+  perf_fd = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (perf_fd >= 0 && perf_open(PERF_COUNT_HW_CACHE_MISSES, perf_fd) < 0) {
+    close(perf_fd);
+    perf_fd = -1;
+  }
+}
+#else
+static void perf_init(void) {}
+#endif
+
+struct sample {
+  double ns;
+  uint64_t cycles;
+  uint64_t misses;
+  uint64_t ops;
+  double start;
+};
+
+static void sample_begin(struct sample *sample) {
+#ifdef __linux__
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+  sample->start = now_ns();
+}
+
+static void sample_end(struct sample *sample, uint64_t ops) {
+  sample->ns += now_ns() - sample->start;
+  sample->ops += ops;
+#ifdef __linux__
+  if (perf_fd >= 0) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    struct {
+      uint64_t nr;
+      uint64_t values[2];
+    } counts;
+    if (read(perf_fd, &counts, sizeof(counts)) == sizeof(counts)) {
+      sample->cycles += counts.values[0];
+      sample->misses += counts.values[1];
+    }
+  }
+#endif
+}
+
+struct config {
+  const char *engine_name;
+  hash_table_engine engine;
+  const struct key_type *key_type;
+  const char *tier;
+  double load_factor;
+  bool json;
+};
+
+static bool first_result = true;
+
+static void report(const struct config *config, const char *workload,
+                   size_t n, const struct sample *sample,
+                   double bytes_per_entry) {
+  double ops = (double)sample->ops;
+  if (config->json) {
+    printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", "
+           "\"key\": \"%s\", \"tier\": \"%s\", \"entries\": %zu, "
+           "\"load_factor\": %.3f, \"ns_per_op\": %.2f, ",
+           first_result ? "" : ",", workload, config->engine_name,
+           config->key_type->name, config->tier, n, config->load_factor,
+           sample->ns / ops);
+    if (perf_fd >= 0)
+      printf("\"cycles_per_op\": %.2f, \"cache_misses_per_op\": %.4f, ",
+             sample->cycles / ops, sample->misses / ops);
+    else
+      printf("\"cycles_per_op\": null, \"cache_misses_per_op\": null, ");
+    printf("\"bytes_per_entry\": %.2f}", bytes_per_entry);
+    first_result = false;
+    return;
+  }
+  char cycles[16] = "-", misses[16] = "-";
+  if (perf_fd >= 0) {
+    snprintf(cycles, sizeof(cycles), "%.1f", sample->cycles / ops);
+    snprintf(misses, sizeof(misses), "%.3f", sample->misses / ops);
+  }
+  printf("%-8s %-7s %-9s %-6s %10zu %6.3f %9.1f %9s %9s %8.1f\n", workload,
+         config->engine_name, config->key_type->name, config->tier, n,
+         config->load_factor, sample->ns / ops, cycles, misses,
+         bytes_per_entry);
+}
+
+static HashTable *create_table(const struct config *config,
+                               size_t initial_capacity,
+                               context_allocator *allocator) {
+  // Growth is held off until just past the largest load factor measured,
+  // so that n keys sit in a table of the tier's capacity.
+  hash_table_options options = {.engine = config->engine,
+                                .max_load_factor = 0.9,
+                                .key_size = config->key_type->key_size,
+                                .value_size = sizeof(uint64_t),
+                                .allocator = allocator,
+                                .initial_capacity = initial_capacity};
+  return hash_table_create_with_options(config->key_type->handler,
+                                        (type_handler){0}, NULL, &options);
+}
+
+static bool fill(HashTable *table, const struct keys *keys, size_t from,
+                 size_t n) {
+  for (size_t i = from; i < from + n; i++) {
+    uint64_t value = i;
+    if (!hash_table_insert(table, key_at(keys, i), &value))
+      return false;
+  }
+  return true;
+}
+
+static bool run_config(const struct config *config, size_t capacity) {
+  size_t n = (size_t)(capacity * config->load_factor);
+  size_t reps = n >= MIN_OPS ? 1 : (MIN_OPS + n - 1) / n;
+  struct keys keys;
+  size_t *order = malloc(sizeof(size_t) * n);
+  bool ok = order && keys_init(&keys, config->key_type, n);
+  if (!ok) {
+    fprintf(stderr, "out of memory\n");
+    free(order);
+    return false;
+  }
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = mix(i) % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  size_t allocated = 0;
+  context_allocator allocator = {counting_alloc, counting_free, NULL,
+                                 &allocated};
+  struct sample insert = {0}, hit = {0}, miss = {0}, churn = {0},
+                delete = {0}, grow = {0};
+  HashTable *table = NULL;
+  double bytes_per_entry = 0;
+
+  for (size_t rep = 0; ok && rep < reps; rep++) {
+    hash_table_destroy(table);
+    table = create_table(config, n, &allocator);
+    ok = table != NULL;
+    sample_begin(&insert);
+    ok = ok && fill(table, &keys, 0, n);
+    sample_end(&insert, n);
+  }
+  if (ok)
+    bytes_per_entry = (double)allocated / n;
+
+  size_t found = 0;
+  for (size_t rep = 0; ok && rep < reps; rep++) {
+    sample_begin(&hit);
+    for (size_t i = 0; i < n; i++)
+      found += hash_table_lookup(table, key_at(&keys, order[i])) != NULL;
+    sample_end(&hit, n);
+    sample_begin(&miss);
+    for (size_t i = 0; i < n; i++)
+      found += hash_table_lookup(table, key_at(&keys, 2 * n + order[i])) !=
+               NULL;
+    sample_end(&miss, n);
+  }
+  if (ok && found != n * reps) {
+    fprintf(stderr, "%s/%s: lookups found %zu of %zu keys\n",
+            config->engine_name, config->key_type->name, found, n * reps);
+    ok = false;
+  }
+
+  // Churn walks a window of n live keys through [0, 2n) and back.
+  size_t oldest = 0;
+  for (size_t rep = 0; ok && rep < reps; rep++) {
+    sample_begin(&churn);
+    for (size_t i = 0; ok && i < n; i++) {
+      size_t newest = (oldest + n) % (2 * n);
+      uint64_t value = newest;
+      ok = hash_table_delete(table, key_at(&keys, oldest)) &&
+           hash_table_insert(table, key_at(&keys, newest), &value);
+      oldest = (oldest + 1) % (2 * n);
+    }
+    sample_end(&churn, n);
+  }
+
+  for (size_t rep = 0; ok && rep < reps; rep++) {
+    if (rep > 0) {
+      hash_table_destroy(table);
+      table = create_table(config, n, &allocator);
+      ok = table && fill(table, &keys, 0, n);
+      oldest = 0;
+    }
+    sample_begin(&delete);
+    for (size_t i = 0; ok && i < n; i++)
+      ok = hash_table_delete(table,
+                             key_at(&keys, (oldest + order[i]) % (2 * n)));
+    sample_end(&delete, n);
+  }
+  hash_table_destroy(table);
+
+  for (size_t rep = 0; ok && rep < reps; rep++) {
+    table = create_table(config, 0, &allocator);
+    ok = table != NULL;
+    sample_begin(&grow);
+    ok = ok && fill(table, &keys, 0, n);
+    sample_end(&grow, n);
+    hash_table_destroy(table);
+  }
+
+  if (ok) {
+    report(config, "insert", n, &insert, bytes_per_entry);
+    report(config, "hit", n, &hit, bytes_per_entry);
+    report(config, "miss", n, &miss, bytes_per_entry);
+    report(config, "churn", n, &churn, bytes_per_entry);
+    report(config, "delete", n, &delete, bytes_per_entry);
+    report(config, "resize", n, &grow, bytes_per_entry);
+  } else {
+    fprintf(stderr, "%s/%s/%s/%.3f: a table operation failed\n",
+            config->engine_name, config->key_type->name, config->tier,
+            config->load_factor);
+  }
+  keys_free(&keys);
+  free(order);
+  return ok;
+}
+
+// Largest power-of-two capacity whose slots fit in bytes.
+static size_t capacity_for_bytes(size_t bytes, size_t bytes_per_slot) {
+  size_t capacity = 16;
+  while (capacity * 2 * bytes_per_slot <= bytes)
+    capacity *= 2;
+  return capacity;
+}
+
+static size_t cache_size(int name, size_t fallback) {
+  long size = sysconf(name);
+  return size > 0 ? (size_t)size : fallback;
+}
+
+int main(int argc, char **argv) {
+  bool json = false, quick = false;
+  const char *only_engine = NULL, *only_key = NULL;
+  size_t llc = cache_size(_SC_LEVEL3_CACHE_SIZE, 8 << 20);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+      only_engine = argv[++i];
+    } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+      only_key = argv[++i];
+    } else if (strcmp(argv[i], "--llc-kb") == 0 && i + 1 < argc) {
+      llc = (size_t)strtoull(argv[++i], NULL, 10) << 10;
+    } else {
+      fprintf(stderr,
+              "usage: %s [--json] [--quick] [--engine NAME] [--key NAME] "
+              "[--llc-kb N]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  const struct {
+    const char *name;
+    size_t bytes;
+  } tiers[] = {{"L1", cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 << 10)},
+               {"L2", cache_size(_SC_LEVEL2_CACHE_SIZE, 1 << 20)},
+               {"LLC", llc / 2},
+               {"10xLLC", llc * 10}};
+  const double load_factors[] = {0.5, 0.75, 0.875};
+  size_t tier_count = sizeof(tiers) / sizeof(tiers[0]) - (quick ? 1 : 0);
+
+  perf_init();
+  if (json) {
+    printf("{\n  \"l1_bytes\": %zu,\n  \"l2_bytes\": %zu,\n"
+           "  \"llc_bytes\": %zu,\n  \"perf_counters\": %s,\n"
+           "  \"results\": [",
+           tiers[0].bytes, tiers[1].bytes, llc,
+           perf_fd >= 0 ? "true" : "false");
+  } else {
+    printf("L1 %zu KiB, L2 %zu KiB, LLC %zu KiB, perf counters %s\n",
+           tiers[0].bytes >> 10, tiers[1].bytes >> 10, llc >> 10,
+           perf_fd >= 0 ? "on" : "unavailable");
+    printf("%-8s %-7s %-9s %-6s %10s %6s %9s %9s %9s %8s\n", "workload",
+           "engine", "key", "tier", "entries", "load", "ns/op", "cycles",
+           "misses", "B/entry");
+  }
+
+  bool ok = true;
+  for (size_t k = 0; ok && k < sizeof(key_types) / sizeof(key_types[0]);
+       k++) {
+    if (only_key && strcmp(only_key, key_types[k].name) != 0)
+      continue;
+    for (size_t t = 0; ok && t < tier_count; t++) {
+      size_t capacity =
+          capacity_for_bytes(tiers[t].bytes, key_types[k].bytes_per_slot);
+      for (size_t l = 0; ok && l < sizeof(load_factors) / sizeof(double);
+           l++) {
+        if (quick && load_factors[l] != 0.75)
+          continue;
+        for (size_t e = 0; ok && e < sizeof(engines) / sizeof(engines[0]);
+             e++) {
+          if (only_engine && strcmp(only_engine, engines[e].name) != 0)
+            continue;
+          struct config config = {engines[e].name, engines[e].engine,
+                                  &key_types[k],   tiers[t].name,
+                                  load_factors[l], json};
+          ok = run_config(&config, capacity);
+        }
+      }
+    }
+  }
+
+  if (json)
+    printf("\n  ]\n}\n");
+  return ok ? 0 : 1;
+}
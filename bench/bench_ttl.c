@@ -0,0 +1,151 @@
+// Expiring sessions through a table created with expiry, against deleting
+// them from an external timer.
+//
+// Usage: bench_ttl [log2_keys]
+//
+// Simulates 60 seconds of 100000 requests each on session ids drawn from
+// 2^log2_keys (default 2^20). A request looks its session up and, if it is
+// missing or expired, starts it again with a 30 second lifetime.
+//
+// The timer version keeps each session's deadline in its value and queues
+// sessions in the order they start. Once a second it deletes every queued
+// session whose deadline has passed, which costs a lookup and a delete
+// each. The expiry version uses hash_table_insert_ttl() and calls
+// hash_table_expire_step() every 1024 requests, with enough slots to sweep
+// the table once every 10 seconds. Reports the nanoseconds per request,
+// expiry included, the longest single expiry call, and the entries left in
+// the table at the end.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SECONDS 60
+#define REQUESTS_PER_SECOND 100000
+#define TTL 30
+#define STEP_EVERY 1024
+#define LAP_SECONDS 10
+
+// The simulated time, in seconds.
+static uint64_t simulated_now;
+
+static uint64_t simulated_clock(void *ctx) {
+  (void)ctx;
+  return simulated_now;
+}
+
+static HashTable *create(bool expiry, size_t universe) {
+  type_handler key_handler = {.equal = equal_u64,
+                              .hash_with_seed = hash_table_hash_u64};
+  hash_table_options options = {.engine = HASH_TABLE_ENGINE_SWISS,
+                                .key_size = sizeof(uint64_t),
+                                .value_size = sizeof(uint64_t),
+                                .initial_capacity = universe,
+                                .expiry = expiry,
+                                .expiry_clock = simulated_clock};
+  HashTable *table = hash_table_create_with_options(
+      key_handler, (type_handler){0}, NULL, &options);
+  if (!table) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return table;
+}
+
+static void report(const char *name, double start, double longest,
+                   const HashTable *table) {
+  double ns = (now_ns() - start) / ((double)SECONDS * REQUESTS_PER_SECOND);
+  printf("%-8s %10.1f %12.1f %10zu\n", name, ns, longest / 1e3,
+         hash_table_count(table));
+}
+
+static void run_timer(const uint64_t *ids, size_t universe) {
+  HashTable *table = create(false, universe);
+  size_t queue_size = (size_t)SECONDS * REQUESTS_PER_SECOND;
+  uint64_t *queue = malloc(sizeof(uint64_t) * queue_size);
+  if (!queue) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  size_t head = 0, tail = 0;
+  double longest = 0;
+  double start = now_ns();
+  for (simulated_now = 0; simulated_now < SECONDS; simulated_now++) {
+    double sweep = now_ns();
+    while (head < tail) {
+      const uint64_t *deadline = hash_table_lookup(table, &queue[head]);
+      // Restarted sessions are queued again further back.
+      if (deadline && *deadline > simulated_now)
+        break;
+      if (deadline)
+        hash_table_delete(table, &queue[head]);
+      head++;
+    }
+    if (now_ns() - sweep > longest)
+      longest = now_ns() - sweep;
+    const uint64_t *second = ids + simulated_now * REQUESTS_PER_SECOND;
+    for (size_t i = 0; i < REQUESTS_PER_SECOND; i++) {
+      const uint64_t *deadline = hash_table_lookup(table, &second[i]);
+      if (deadline && *deadline > simulated_now)
+        continue;
+      uint64_t expires = simulated_now + TTL;
+      hash_table_insert(table, (void *)&second[i], &expires);
+      queue[tail++] = second[i];
+    }
+  }
+  report("timer", start, longest, table);
+  hash_table_destroy(table);
+  free(queue);
+}
+
+static void run_expiry(const uint64_t *ids, size_t universe) {
+  HashTable *table = create(true, universe);
+  size_t per_lap = (size_t)REQUESTS_PER_SECOND * LAP_SECONDS;
+  size_t slots =
+      (hash_table_capacity(table) * STEP_EVERY + per_lap - 1) / per_lap;
+  double longest = 0;
+  double start = now_ns();
+  for (simulated_now = 0; simulated_now < SECONDS; simulated_now++) {
+    const uint64_t *second = ids + simulated_now * REQUESTS_PER_SECOND;
+    for (size_t i = 0; i < REQUESTS_PER_SECOND; i++) {
+      if (!hash_table_lookup(table, &second[i]))
+        hash_table_insert_ttl(table, (void *)&second[i],
+                              (void *)&second[i], TTL);
+      if (i % STEP_EVERY == STEP_EVERY - 1) {
+        double step = now_ns();
+        hash_table_expire_step(table, slots);
+        if (now_ns() - step > longest)
+          longest = now_ns() - step;
+      }
+    }
+  }
+  report("expiry", start, longest, table);
+  hash_table_destroy(table);
+}
+
+int main(int argc, char **argv) {
+  int log2_keys = argc > 1 ? atoi(argv[1]) : 20;
+  if (log2_keys < 12 || log2_keys > 26) {
+    fprintf(stderr, "log2_keys must be between 12 and 26\n");
+    return 1;
+  }
+  size_t universe = (size_t)1 << log2_keys;
+  size_t requests = (size_t)SECONDS * REQUESTS_PER_SECOND;
+  uint64_t *ids = malloc(sizeof(uint64_t) * requests);
+  if (!ids) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < requests; i++)
+    ids[i] = next_random() & (universe - 1);
+
+  printf("%zu requests over %zu sessions, %d s lifetime\n", requests,
+         universe, TTL);
+  printf("%-8s %10s %12s %10s\n", "expiry", "ns/req", "longest us",
+         "entries");
+  run_timer(ids, universe);
+  run_expiry(ids, universe);
+  free(ids);
+  return 0;
+}
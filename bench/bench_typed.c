@@ -0,0 +1,215 @@
+// Tables generated by HT_DEFINE() against the generic HashTable with the
+// same inline layout, for a uint64_t -> uint64_t map and a fixed-size
+// string -> struct map.
+//
+// Usage: bench_typed [log2_entries]
+//
+// Inserts 2^log2_entries (default 2^20) keys, then looks every key up in a
+// random order, then looks up as many absent keys, and reports ns per
+// operation.
+
+#define _POSIX_C_SOURCE 199309L
+#include "bench_common.h"
+#include "hashtable_typed.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  char bytes[24];
+} name_key;
+
+typedef struct {
+  uint32_t id;
+  uint32_t flags;
+  double score;
+} record;
+
+static inline uint64_t hash_u64(const uint64_t *key) { return *key; }
+
+static inline bool eq_u64(const uint64_t *a, const uint64_t *b) {
+  return *a == *b;
+}
+
+// FNV-1a over the whole fixed-size key.
+static inline uint64_t hash_name(const name_key *key) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < sizeof(key->bytes); i++) {
+    hash ^= (unsigned char)key->bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static inline bool eq_name(const name_key *a, const name_key *b) {
+  return memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+HT_DEFINE(u64_map, uint64_t, uint64_t, hash_u64, eq_u64)
+HT_DEFINE(name_map, name_key, record, hash_name, eq_name)
+
+// The generic table calls the same functions through the handlers.
+static uint64_t generic_hash_u64(const void *key) { return hash_u64(key); }
+static bool generic_eq_u64(const void *a, const void *b) {
+  return eq_u64(a, b);
+}
+static uint64_t generic_hash_name(const void *key) { return hash_name(key); }
+static bool generic_eq_name(const void *a, const void *b) {
+  return eq_name(a, b);
+}
+
+static HashTable *create_generic(hash_function hash, key_equal_function equal,
+                                 size_t key_size, size_t value_size) {
+  type_handler key_handler = {.equal = equal, .hash = hash};
+  hash_table_options options = {.key_size = key_size,
+                                .value_size = value_size};
+  return hash_table_create_with_options(key_handler, (type_handler){0}, NULL,
+                                        &options);
+}
+
+static void make_name(name_key *key, uint64_t n) {
+  snprintf(key->bytes, sizeof(key->bytes), "user-%016llx",
+           (unsigned long long)n);
+}
+
+static void report(const char *map, const char *impl, double insert_ns,
+                   double hit_ns, double miss_ns) {
+  printf("%-10s %-8s %10.1f %10.1f %10.1f\n", map, impl, insert_ns, hit_ns,
+         miss_ns);
+}
+
+static int bench_u64(size_t n, const uint64_t *keys, const size_t *order) {
+  double start, insert_ns, hit_ns, miss_ns;
+  uint64_t sum = 0;
+
+  HashTable *generic = create_generic(generic_hash_u64, generic_eq_u64,
+                                      sizeof(uint64_t), sizeof(uint64_t));
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    hash_table_insert(generic, (void *)&keys[i], (void *)&keys[i]);
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += *(uint64_t *)hash_table_lookup(generic, &keys[order[i]]);
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = keys[order[i]] + 1; // keys are even
+    sum += hash_table_lookup(generic, &key) != NULL;
+  }
+  miss_ns = (now_ns() - start) / n;
+  report("u64->u64", "generic", insert_ns, hit_ns, miss_ns);
+  hash_table_destroy(generic);
+
+  u64_map *typed = u64_map_create(0);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    u64_map_insert(typed, keys[i], keys[i]);
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= *u64_map_lookup(typed, keys[order[i]]);
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= u64_map_lookup(typed, keys[order[i]] + 1) != NULL;
+  miss_ns = (now_ns() - start) / n;
+  report("u64->u64", "typed", insert_ns, hit_ns, miss_ns);
+  u64_map_destroy(typed);
+
+  if (sum != 0) {
+    fprintf(stderr, "u64 maps disagree\n");
+    return 1;
+  }
+  return 0;
+}
+
+static int bench_name(size_t n, const name_key *keys, const name_key *missing,
+                      const size_t *order) {
+  double start, insert_ns, hit_ns, miss_ns;
+  uint64_t sum = 0;
+
+  HashTable *generic = create_generic(generic_hash_name, generic_eq_name,
+                                      sizeof(name_key), sizeof(record));
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    record r = {(uint32_t)i, 0, i * 0.5};
+    hash_table_insert(generic, (void *)&keys[i], &r);
+  }
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += ((record *)hash_table_lookup(generic, &keys[order[i]]))->id;
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum += hash_table_lookup(generic, &missing[order[i]]) != NULL;
+  miss_ns = (now_ns() - start) / n;
+  report("name->rec", "generic", insert_ns, hit_ns, miss_ns);
+  hash_table_destroy(generic);
+
+  name_map *typed = name_map_create(0);
+  start = now_ns();
+  for (size_t i = 0; i < n; i++) {
+    record r = {(uint32_t)i, 0, i * 0.5};
+    name_map_insert(typed, keys[i], r);
+  }
+  insert_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= name_map_lookup(typed, keys[order[i]])->id;
+  hit_ns = (now_ns() - start) / n;
+  start = now_ns();
+  for (size_t i = 0; i < n; i++)
+    sum -= name_map_lookup(typed, missing[order[i]]) != NULL;
+  miss_ns = (now_ns() - start) / n;
+  report("name->rec", "typed", insert_ns, hit_ns, miss_ns);
+  name_map_destroy(typed);
+
+  if (sum != 0) {
+    fprintf(stderr, "name maps disagree\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int log2_entries = argc > 1 ? atoi(argv[1]) : 20;
+  if (log2_entries < 10 || log2_entries > 28) {
+    fprintf(stderr, "log2_entries must be between 10 and 28\n");
+    return 1;
+  }
+  size_t n = (size_t)1 << log2_entries;
+
+  uint64_t *u64_keys = malloc(sizeof(uint64_t) * n);
+  name_key *name_keys = malloc(sizeof(name_key) * n);
+  name_key *missing_names = malloc(sizeof(name_key) * n);
+  size_t *order = malloc(sizeof(size_t) * n);
+  if (!u64_keys || !name_keys || !missing_names || !order) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < n; i++) {
+    u64_keys[i] = next_random() & ~(uint64_t)1;
+    make_name(&name_keys[i], i);
+    make_name(&missing_names[i], n + i);
+    order[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = next_random() % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  printf("%zu entries, ns per operation\n", n);
+  printf("%-10s %-8s %10s %10s %10s\n", "map", "impl", "insert", "hit",
+         "miss");
+  int failed = bench_u64(n, u64_keys, order) ||
+               bench_name(n, name_keys, missing_names, order);
+
+  free(u64_keys);
+  free(name_keys);
+  free(missing_names);
+  free(order);
+  return failed;
+}
@@ -0,0 +1,548 @@
+#define _POSIX_C_SOURCE 200809L
+#include "concurrent_hashtable.h"
+#include "hashtable_internal.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define INITIAL_CAPACITY 16
+#define MAX_LOAD_FACTOR 0.75
+#define DEFAULT_MAX_READERS 64
+#define CACHE_LINE_SIZE 64
+// Retired nodes and arrays are collected once this many have piled up.
+#define RECLAIM_THRESHOLD 64
+
+// One atomic control byte per slot filters probes before the node is
+// dereferenced: 0 for an empty slot, 1 for a tombstone, otherwise 0x80 | the
+// top 7 bits of the hash.
+#define TAG_EMPTY 0
+#define TAG_DELETED 1
+
+static inline uint8_t tag_for(uint64_t hash) {
+  return (uint8_t)(0x80 | (hash >> 57));
+}
+
+// Nodes are never modified after they are published. Inline keys and
+// values follow the header.
+struct node {
+  uint64_t hash;
+  void *key;
+  void *value;
+  uint64_t retire_epoch;
+  struct node *next_retired;
+};
+
+#define NODE_HEADER_SIZE ht_align_up(sizeof(struct node), INLINE_ALIGNMENT)
+
+struct slot_array {
+  size_t capacity; // always a power of two
+  _Atomic uint8_t *tags;
+  _Atomic(struct node *) *nodes;
+  uint64_t retire_epoch;
+  struct slot_array *next_retired;
+};
+
+// epoch is 0 outside a read section, or the table epoch the reader saw when
+// it entered one.
+struct concurrent_reader {
+  _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t epoch;
+  atomic_bool in_use;
+  ConcurrentHashTable *table;
+};
+
+struct ConcurrentHashTable {
+  _Atomic(struct slot_array *) slots;
+  type_handler key_handler;
+  type_handler value_handler;
+  context_allocator alloc_handler;
+  size_t key_size;
+  size_t value_size;
+  size_t value_offset; // of inline values, from the start of the node
+  uint64_t seed;
+
+  // Everything below is only touched with write_lock held, except count,
+  // epoch and the readers' own fields.
+  pthread_mutex_t write_lock;
+  atomic_size_t count;
+  size_t tombstones;
+  _Atomic uint64_t epoch; // starts at 1, bumped on every retirement
+  struct node *retired_nodes;
+  struct slot_array *retired_arrays;
+  size_t retired_count;
+  concurrent_reader *readers;
+  size_t max_readers;
+};
+
+static void *table_alloc(const ConcurrentHashTable *table, size_t size,
+                         size_t alignment) {
+  return table->alloc_handler.alloc(table->alloc_handler.ctx, size,
+                                    alignment);
+}
+
+static void table_free(const ConcurrentHashTable *table, void *ptr,
+                       size_t size) {
+  table->alloc_handler.free(table->alloc_handler.ctx, ptr, size);
+}
+
+static uint64_t hash_key(const ConcurrentHashTable *table, const void *key) {
+  return ht_hash_with(&table->key_handler, key, table->key_size, table->seed);
+}
+
+static size_t node_size(const ConcurrentHashTable *table) {
+  return table->value_offset + table->value_size;
+}
+
+static struct node *new_node(const ConcurrentHashTable *table, const void *key,
+                             uint64_t hash, const void *value) {
+  struct node *node = table_alloc(table, node_size(table), ALLOC_ALIGNMENT);
+  if (!node)
+    return NULL;
+  node->hash = hash;
+  if (table->key_size) {
+    node->key = (unsigned char *)node + NODE_HEADER_SIZE;
+    memcpy(node->key, key, table->key_size);
+  } else {
+    node->key = ht_copy_with(&table->key_handler, &table->alloc_handler, key);
+  }
+  if (table->value_size) {
+    node->value = (unsigned char *)node + table->value_offset;
+    memcpy(node->value, value, table->value_size);
+  } else {
+    node->value =
+        ht_copy_with(&table->value_handler, &table->alloc_handler, value);
+  }
+  node->next_retired = NULL;
+  return node;
+}
+
+// Whether destroying this side of a node frees anything that a release of
+// the table's allocator would not.
+static bool needs_destroy(const ConcurrentHashTable *table,
+                          const type_handler *handler, size_t inline_size) {
+  if (inline_size)
+    return false;
+  if (handler->destroy_with_allocator)
+    return !table->alloc_handler.release;
+  return handler->destroy != NULL;
+}
+
+// free_node() for concurrent_hash_table_destroy(), which leaves what the
+// allocator's release will free anyway.
+static void destroy_node(const ConcurrentHashTable *table, struct node *node) {
+  if (needs_destroy(table, &table->key_handler, table->key_size))
+    ht_destroy_with(&table->key_handler, &table->alloc_handler, node->key);
+  if (needs_destroy(table, &table->value_handler, table->value_size))
+    ht_destroy_with(&table->value_handler, &table->alloc_handler,
+                    node->value);
+  table_free(table, node, node_size(table));
+}
+
+static void free_node(const ConcurrentHashTable *table, struct node *node) {
+  if (!table->key_size)
+    ht_destroy_with(&table->key_handler, &table->alloc_handler, node->key);
+  if (!table->value_size)
+    ht_destroy_with(&table->value_handler, &table->alloc_handler,
+                    node->value);
+  table_free(table, node, node_size(table));
+}
+
+// Header, node pointers and tags share one allocation.
+static size_t slot_array_size(size_t capacity) {
+  return sizeof(struct slot_array) +
+         (sizeof(_Atomic(struct node *)) + 1) * capacity;
+}
+
+static struct slot_array *new_slot_array(const ConcurrentHashTable *table,
+                                         size_t capacity) {
+  size_t nodes_size = sizeof(_Atomic(struct node *)) * capacity;
+  struct slot_array *slots =
+      table_alloc(table, slot_array_size(capacity), ALLOC_ALIGNMENT);
+  if (!slots)
+    return NULL;
+  slots->capacity = capacity;
+  slots->nodes = (_Atomic(struct node *) *)(slots + 1);
+  slots->tags = (_Atomic uint8_t *)((unsigned char *)slots->nodes + nodes_size);
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&slots->nodes[i], NULL);
+    atomic_init(&slots->tags[i], TAG_EMPTY);
+  }
+  slots->next_retired = NULL;
+  return slots;
+}
+
+static size_t readers_size(const ConcurrentHashTable *table) {
+  return sizeof(concurrent_reader) * table->max_readers;
+}
+
+static void free_slot_array(const ConcurrentHashTable *table,
+                            struct slot_array *slots) {
+  table_free(table, slots, slot_array_size(slots->capacity));
+}
+
+// Writer-side probe. Returns the slot holding key, or SLOT_NONE and the
+// first reusable slot of the probe sequence in insert_index.
+static size_t find_slot(const ConcurrentHashTable *table,
+                        const struct slot_array *slots, const void *key,
+                        uint64_t hash, size_t *insert_index) {
+  size_t mask = slots->capacity - 1;
+  size_t index = hash & mask;
+  uint8_t tag = tag_for(hash);
+  size_t first_deleted = SLOT_NONE;
+
+  for (size_t probes = 0; probes < slots->capacity; probes++) {
+    uint8_t t = atomic_load_explicit(&slots->tags[index], memory_order_relaxed);
+    if (t == TAG_EMPTY) {
+      if (insert_index)
+        *insert_index = first_deleted != SLOT_NONE ? first_deleted : index;
+      return SLOT_NONE;
+    }
+    if (t == TAG_DELETED) {
+      if (first_deleted == SLOT_NONE)
+        first_deleted = index;
+    } else if (t == tag) {
+      struct node *node =
+          atomic_load_explicit(&slots->nodes[index], memory_order_relaxed);
+      if (node->hash == hash && table->key_handler.equal(node->key, key))
+        return index;
+    }
+    index = (index + 1) & mask;
+  }
+  if (insert_index)
+    *insert_index = first_deleted;
+  return SLOT_NONE;
+}
+
+// Publishes node into an empty or deleted slot. The node pointer is stored
+// before the tag, so a reader that sees the new tag also sees the node.
+static void publish(struct slot_array *slots, size_t index, struct node *node) {
+  atomic_store_explicit(&slots->nodes[index], node, memory_order_release);
+  atomic_store_explicit(&slots->tags[index], tag_for(node->hash),
+                        memory_order_release);
+}
+
+// An object retired at epoch e can be freed once every reader in a read
+// section entered it at an epoch after e, since such a reader loaded the
+// epoch after the object was unlinked and cannot reach it.
+static uint64_t safe_epoch(const ConcurrentHashTable *table) {
+  atomic_thread_fence(memory_order_seq_cst);
+  uint64_t min = UINT64_MAX;
+  for (size_t i = 0; i < table->max_readers; i++) {
+    uint64_t epoch = atomic_load(&table->readers[i].epoch);
+    if (epoch != 0 && epoch < min)
+      min = epoch;
+  }
+  return min;
+}
+
+static void reclaim(ConcurrentHashTable *table, uint64_t before) {
+  struct node **link = &table->retired_nodes;
+  while (*link) {
+    struct node *node = *link;
+    if (node->retire_epoch < before) {
+      *link = node->next_retired;
+      free_node(table, node);
+      table->retired_count--;
+    } else {
+      link = &node->next_retired;
+    }
+  }
+  struct slot_array **array_link = &table->retired_arrays;
+  while (*array_link) {
+    struct slot_array *slots = *array_link;
+    if (slots->retire_epoch < before) {
+      *array_link = slots->next_retired;
+      free_slot_array(table, slots);
+      table->retired_count--;
+    } else {
+      array_link = &slots->next_retired;
+    }
+  }
+}
+
+static void retire_node(ConcurrentHashTable *table, struct node *node) {
+  node->retire_epoch = atomic_fetch_add(&table->epoch, 1);
+  node->next_retired = table->retired_nodes;
+  table->retired_nodes = node;
+  if (++table->retired_count >= RECLAIM_THRESHOLD)
+    reclaim(table, safe_epoch(table));
+}
+
+static void retire_slot_array(ConcurrentHashTable *table,
+                              struct slot_array *slots) {
+  slots->retire_epoch = atomic_fetch_add(&table->epoch, 1);
+  slots->next_retired = table->retired_arrays;
+  table->retired_arrays = slots;
+  if (++table->retired_count >= RECLAIM_THRESHOLD)
+    reclaim(table, safe_epoch(table));
+}
+
+// Copies the live node pointers into a fresh array, dropping tombstones,
+// and swaps it in. Readers still probing the old array keep seeing the
+// entries it held.
+static bool rebuild(ConcurrentHashTable *table, size_t capacity) {
+  struct slot_array *old =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  struct slot_array *slots = new_slot_array(table, capacity);
+  if (!slots)
+    return false;
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < old->capacity; i++) {
+    if (atomic_load_explicit(&old->tags[i], memory_order_relaxed) < 0x80)
+      continue;
+    struct node *node =
+        atomic_load_explicit(&old->nodes[i], memory_order_relaxed);
+    size_t index = node->hash & mask;
+    while (atomic_load_explicit(&slots->tags[index], memory_order_relaxed) !=
+           TAG_EMPTY) {
+      index = (index + 1) & mask;
+    }
+    publish(slots, index, node);
+  }
+  atomic_store_explicit(&table->slots, slots, memory_order_release);
+  table->tombstones = 0;
+  retire_slot_array(table, old);
+  return true;
+}
+
+// Same policy as the main table: rebuild at the same size when dropping
+// tombstones frees enough room, otherwise double.
+static bool make_room(ConcurrentHashTable *table) {
+  const struct slot_array *slots =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  size_t count = atomic_load_explicit(&table->count, memory_order_relaxed);
+  double limit = slots->capacity * MAX_LOAD_FACTOR;
+  if (count + table->tombstones + 1 <= limit)
+    return true;
+  size_t capacity = slots->capacity;
+  if (count + 1 > limit * 0.75)
+    capacity *= 2;
+  return rebuild(table, capacity);
+}
+
+ConcurrentHashTable *
+concurrent_hash_table_create(type_handler key_handler,
+                             type_handler value_handler,
+                             const concurrent_hash_table_options *options) {
+  concurrent_hash_table_options opts =
+      options ? *options : (concurrent_hash_table_options){0};
+  if (opts.max_readers == 0)
+    opts.max_readers = DEFAULT_MAX_READERS;
+
+  size_t capacity =
+      ht_capacity_for(opts.initial_capacity, INITIAL_CAPACITY, MAX_LOAD_FACTOR);
+  if (!capacity)
+    return NULL;
+  context_allocator allocator =
+      opts.allocator ? *opts.allocator : ht_default_allocator();
+  ConcurrentHashTable *table = allocator.alloc(
+      allocator.ctx, sizeof(ConcurrentHashTable), ALLOC_ALIGNMENT);
+  if (!table)
+    return NULL;
+  table->key_handler = key_handler;
+  table->value_handler = value_handler;
+  table->alloc_handler = allocator;
+  table->key_size = opts.key_size;
+  table->seed = opts.seed;
+  table->value_size = opts.value_size;
+  table->value_offset =
+      NODE_HEADER_SIZE + ht_align_up(opts.key_size, INLINE_ALIGNMENT);
+  atomic_init(&table->count, 0);
+  table->tombstones = 0;
+  atomic_init(&table->epoch, 1);
+  table->retired_nodes = NULL;
+  table->retired_arrays = NULL;
+  table->retired_count = 0;
+  table->max_readers = opts.max_readers;
+
+  struct slot_array *slots = new_slot_array(table, capacity);
+  table->readers = table_alloc(table, readers_size(table), CACHE_LINE_SIZE);
+  if (!slots || !table->readers ||
+      pthread_mutex_init(&table->write_lock, NULL) != 0) {
+    if (slots)
+      free_slot_array(table, slots);
+    if (table->readers)
+      table_free(table, table->readers, readers_size(table));
+    allocator.free(allocator.ctx, table, sizeof(ConcurrentHashTable));
+    return NULL;
+  }
+  atomic_init(&table->slots, slots);
+  for (size_t i = 0; i < opts.max_readers; i++) {
+    atomic_init(&table->readers[i].epoch, 0);
+    atomic_init(&table->readers[i].in_use, false);
+    table->readers[i].table = table;
+  }
+  return table;
+}
+
+void concurrent_hash_table_destroy(ConcurrentHashTable *table) {
+  if (!table)
+    return;
+  // Retired and live nodes alike go through destroy_node().
+  while (table->retired_nodes) {
+    struct node *node = table->retired_nodes;
+    table->retired_nodes = node->next_retired;
+    destroy_node(table, node);
+  }
+  reclaim(table, UINT64_MAX);
+  struct slot_array *slots =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  for (size_t i = 0; i < slots->capacity; i++) {
+    if (atomic_load_explicit(&slots->tags[i], memory_order_relaxed) >= 0x80)
+      destroy_node(table, atomic_load_explicit(&slots->nodes[i],
+                                               memory_order_relaxed));
+  }
+  free_slot_array(table, slots);
+  pthread_mutex_destroy(&table->write_lock);
+  table_free(table, table->readers, readers_size(table));
+
+  context_allocator allocator = table->alloc_handler;
+  if (allocator.release) {
+    allocator.release(allocator.ctx);
+  } else {
+    allocator.free(allocator.ctx, table, sizeof(ConcurrentHashTable));
+  }
+}
+
+concurrent_reader *
+concurrent_hash_table_reader_register(ConcurrentHashTable *table) {
+  for (size_t i = 0; i < table->max_readers; i++) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&table->readers[i].in_use, &expected,
+                                       true))
+      return &table->readers[i];
+  }
+  return NULL;
+}
+
+void concurrent_hash_table_reader_unregister(concurrent_reader *reader) {
+  if (!reader)
+    return;
+  atomic_store(&reader->epoch, 0);
+  atomic_store(&reader->in_use, false);
+}
+
+// The fence orders the announcement before every load of the read section,
+// pairing with the fence in safe_epoch(): either the writer sees this
+// reader's epoch, or the reader sees the writer's unlinking stores.
+void concurrent_hash_table_read_begin(concurrent_reader *reader) {
+  atomic_store(&reader->epoch, atomic_load(&reader->table->epoch));
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+void concurrent_hash_table_read_end(concurrent_reader *reader) {
+  atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+void *concurrent_hash_table_lookup(const ConcurrentHashTable *table,
+                                   const void *key) {
+  const struct slot_array *slots =
+      atomic_load_explicit(&table->slots, memory_order_acquire);
+  uint64_t hash = hash_key(table, key);
+  uint8_t tag = tag_for(hash);
+  size_t mask = slots->capacity - 1;
+  size_t index = hash & mask;
+
+  for (size_t probes = 0; probes < slots->capacity; probes++) {
+    uint8_t t = atomic_load_explicit(&slots->tags[index], memory_order_acquire);
+    if (t == TAG_EMPTY)
+      return NULL;
+    if (t == tag) {
+      // The slot may have been deleted or reused since its tag was read;
+      // the node's own hash and key decide.
+      const struct node *node =
+          atomic_load_explicit(&slots->nodes[index], memory_order_acquire);
+      if (node && node->hash == hash &&
+          table->key_handler.equal(node->key, key))
+        return node->value;
+    }
+    index = (index + 1) & mask;
+  }
+  return NULL;
+}
+
+bool concurrent_hash_table_insert(ConcurrentHashTable *table, void *key,
+                                  void *value) {
+  uint64_t hash = hash_key(table, key);
+  // Allocating under the lock keeps the allocator single-threaded.
+  pthread_mutex_lock(&table->write_lock);
+  struct node *node = new_node(table, key, hash, value);
+  if (!node) {
+    pthread_mutex_unlock(&table->write_lock);
+    return false;
+  }
+  struct slot_array *slots =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  size_t insert_at = SLOT_NONE;
+  size_t index = find_slot(table, slots, key, hash, &insert_at);
+
+  if (index != SLOT_NONE) {
+    // Replace the whole node; readers holding the old value keep it until
+    // they leave their read section.
+    struct node *old =
+        atomic_load_explicit(&slots->nodes[index], memory_order_relaxed);
+    atomic_store_explicit(&slots->nodes[index], node, memory_order_release);
+    retire_node(table, old);
+    pthread_mutex_unlock(&table->write_lock);
+    return true;
+  }
+
+  if (!make_room(table)) {
+    free_node(table, node);
+    pthread_mutex_unlock(&table->write_lock);
+    return false;
+  }
+  struct slot_array *current =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  if (current != slots)
+    find_slot(table, current, key, hash, &insert_at);
+  if (atomic_load_explicit(&current->tags[insert_at], memory_order_relaxed) ==
+      TAG_DELETED)
+    table->tombstones--;
+  publish(current, insert_at, node);
+  atomic_fetch_add_explicit(&table->count, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&table->write_lock);
+  return true;
+}
+
+bool concurrent_hash_table_delete(ConcurrentHashTable *table,
+                                  const void *key) {
+  uint64_t hash = hash_key(table, key);
+  pthread_mutex_lock(&table->write_lock);
+  struct slot_array *slots =
+      atomic_load_explicit(&table->slots, memory_order_relaxed);
+  size_t index = find_slot(table, slots, key, hash, NULL);
+  if (index == SLOT_NONE) {
+    pthread_mutex_unlock(&table->write_lock);
+    return false;
+  }
+
+  struct node *node =
+      atomic_load_explicit(&slots->nodes[index], memory_order_relaxed);
+  atomic_store_explicit(&slots->tags[index], TAG_DELETED, memory_order_release);
+  atomic_store_explicit(&slots->nodes[index], NULL, memory_order_release);
+  atomic_fetch_sub_explicit(&table->count, 1, memory_order_relaxed);
+  table->tombstones++;
+
+  // As in the linear engine, a tombstone right before an empty slot ends
+  // no probe sequence and can become empty, along with the tombstones
+  // before it. No key lives past an empty slot, so readers lose nothing.
+  size_t mask = slots->capacity - 1;
+  if (atomic_load_explicit(&slots->tags[(index + 1) & mask],
+                           memory_order_relaxed) == TAG_EMPTY) {
+    while (atomic_load_explicit(&slots->tags[index], memory_order_relaxed) ==
+           TAG_DELETED) {
+      atomic_store_explicit(&slots->tags[index], TAG_EMPTY,
+                            memory_order_release);
+      table->tombstones--;
+      index = (index - 1) & mask;
+    }
+  }
+
+  retire_node(table, node);
+  pthread_mutex_unlock(&table->write_lock);
+  return true;
+}
+
+size_t concurrent_hash_table_count(const ConcurrentHashTable *table) {
+  return atomic_load_explicit(&table->count, memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef CUSTOM_CONCURRENT_HASH_TABLE_H
+#define CUSTOM_CONCURRENT_HASH_TABLE_H
+
+#include "hashtable.h"
+
+// A table for read-mostly workloads whose lookups take no locks and write
+// nothing shared. Writers are serialized by a mutex. Every entry lives in
+// its own immutable node that is published into a slot with a single
+// atomic store, so a reader always sees either the old or the new entry,
+// never a half-written one. Nodes and slot arrays that writers remove are
+// freed only once every reader that might still see them has left its
+// read section (epoch-based reclamation).
+//
+// Readers register once per thread and bracket every lookup, and every use
+// of the value it returns, with read_begin()/read_end():
+//
+//   concurrent_reader *reader = concurrent_hash_table_reader_register(table);
+//   concurrent_hash_table_read_begin(reader);
+//   const char *value = concurrent_hash_table_lookup(table, "key");
+//   ... use value ...
+//   concurrent_hash_table_read_end(reader);
+
+typedef struct {
+  // Number of entries to size the table for up front.
+  size_t initial_capacity;
+  // Maximum number of readers registered at the same time. 0 selects 64.
+  size_t max_readers;
+  // Store keys and values inline in the node instead of copying them
+  // through the type handlers, as in hash_table_options.
+  size_t key_size;
+  size_t value_size;
+  // Passed to the key handler's hash_with_seed, as in hash_table_options.
+  uint64_t seed;
+  // Allocator for the table, its nodes and slot arrays, and for handlers
+  // that use copy_with_allocator, as in hash_table_options. Only writers
+  // and destroy call it, with the write lock held, so it need not be
+  // thread-safe. NULL selects malloc().
+  const context_allocator *allocator;
+} concurrent_hash_table_options;
+
+typedef struct ConcurrentHashTable ConcurrentHashTable;
+typedef struct concurrent_reader concurrent_reader;
+
+// options may be NULL. The handlers' *_with_allocator callbacks, if set,
+// are given the table's allocator.
+ConcurrentHashTable *
+concurrent_hash_table_create(type_handler key_handler,
+                             type_handler value_handler,
+                             const concurrent_hash_table_options *options);
+// No reader may be inside a read section.
+void concurrent_hash_table_destroy(ConcurrentHashTable *table);
+
+// Returns NULL when max_readers are already registered.
+concurrent_reader *
+concurrent_hash_table_reader_register(ConcurrentHashTable *table);
+void concurrent_hash_table_reader_unregister(concurrent_reader *reader);
+void concurrent_hash_table_read_begin(concurrent_reader *reader);
+void concurrent_hash_table_read_end(concurrent_reader *reader);
+
+// Must be called inside a read section. The returned value stays valid
+// until the caller's read_end(), even if the key is replaced or deleted
+// meanwhile.
+void *concurrent_hash_table_lookup(const ConcurrentHashTable *table,
+                                   const void *key);
+bool concurrent_hash_table_insert(ConcurrentHashTable *table, void *key,
+                                  void *value);
+bool concurrent_hash_table_delete(ConcurrentHashTable *table, const void *key);
+size_t concurrent_hash_table_count(const ConcurrentHashTable *table);
+
+#endif
@@ -1,37 +1,138 @@
-#include "hashtable.h"
+#include "hashtable_internal.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #define INITIAL_CAPACITY 16
 #define MAX_LOAD_FACTOR 0.75
-#define STATE_EMPTY 0b00
-#define STATE_OCCUPIED 0b01
-#define STATE_DELETED 0b10
+#define SWISS_MAX_LOAD_FACTOR 0.875
+#define ROBIN_HOOD_MAX_LOAD_FACTOR 0.9
+// Keys hashed and prefetched at a time by the batch functions.
+#define BATCH_CHUNK 16
+// Slots of the old arrays an incremental resize moves per insert or delete.
+// With at least 2 per insert the move finishes before the new arrays, which
+// start under half full, reach their load limit.
+#define RESIZE_STEP 32
+// The clock hand visits slots in the order of its count times this odd
+// constant, which reaches every slot once per lap. Evicting in slot order
+// would empty one SWISS group while its neighbours stay full, and deletes
+// from full groups leave tombstones that force rehashes.
+#define CLOCK_STRIDE 0x9E3779B97F4A7C15ULL
 
-struct InternalEntry {
-  void *key;
-  void *value;
-};
+static void *default_alloc(void *ctx, size_t size, size_t alignment) {
+  (void)ctx;
+  if (alignment <= _Alignof(max_align_t))
+    return malloc(size);
+  // aligned_alloc() wants a size that is a multiple of the alignment.
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
 
-struct HashTable {
-  type_handler key_handler;
-  type_handler value_handler;
-  allocator alloc_handler;
-  size_t capacity;
-  size_t count;
-  uint8_t *control_bytes;
-  struct InternalEntry *entries;
-};
+static void default_free(void *ctx, void *ptr, size_t size) {
+  (void)ctx;
+  (void)size;
+  free(ptr);
+}
 
-static void *default_alloc(size_t size) { return malloc(size); }
-static void default_free(void *ptr) { free(ptr); }
-static bool resize(HashTable *table, size_t new_capacity);
+context_allocator ht_default_allocator(void) {
+  return (context_allocator){default_alloc, default_free, NULL, NULL};
+}
 
-static uint8_t get_state(const HashTable *table, size_t index) {
-  size_t byte_index = index / 4;
-  size_t bit_offset = (index % 4) * 2;
-  return (table->control_bytes[byte_index] >> bit_offset) & 0b11;
+// Adapters for the context-free allocator struct. Its functions are
+// expected to return memory suitable for any type, so alignment is not
+// passed on.
+static void *legacy_alloc(void *ctx, size_t size, size_t alignment) {
+  (void)alignment;
+  return ((const allocator *)ctx)->alloc(size);
+}
+
+static void legacy_free(void *ctx, void *ptr, size_t size) {
+  (void)size;
+  ((const allocator *)ctx)->free(ptr);
+}
+
+// Without HASH_TABLE_STATS these are empty and compile away.
+#ifdef HASH_TABLE_STATS
+_Thread_local size_t ht_stats_probes;
+
+static bool stats_create(HashTable *table) {
+  table->stats = ht_alloc(table, sizeof(struct ht_stats));
+  if (table->stats)
+    memset(table->stats, 0, sizeof(struct ht_stats));
+  return table->stats != NULL;
+}
+
+static void stats_destroy(HashTable *table) {
+  ht_free(table, table->stats, sizeof(struct ht_stats));
+}
+
+static uint64_t stats_clock(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void stats_begin_find(void) { ht_stats_probes = 0; }
+
+// Files the probes counted since stats_begin_find() under op.
+static void stats_end_find(const HashTable *table, hash_table_op op) {
+  size_t bucket = 0;
+  for (size_t probes = ht_stats_probes;
+       probes > 1 && bucket < HASH_TABLE_PROBE_BUCKETS - 1; probes >>= 1)
+    bucket++;
+  HT_STATS_ADD(table, probe_lengths[op][bucket], 1);
+}
+
+static void stats_record_resize(const HashTable *table, uint64_t start) {
+  HT_STATS_ADD(table, resizes, 1);
+  HT_STATS_ADD(table, resize_ns, stats_clock() - start);
+}
+
+static void stats_load(const HashTable *table, hash_table_stats *stats) {
+  const struct ht_stats *counters = table->stats;
+  stats->counters = true;
+  for (int op = 0; op < HASH_TABLE_OP_COUNT; op++) {
+    for (int i = 0; i < HASH_TABLE_PROBE_BUCKETS; i++)
+      stats->probe_lengths[op][i] = counters->probe_lengths[op][i];
+  }
+  stats->hash_calls = counters->hash_calls;
+  stats->equal_calls = counters->equal_calls;
+  stats->resizes = counters->resizes;
+  stats->resize_ns = counters->resize_ns;
+  stats->rehashes = counters->rehashes;
+}
+
+static void stats_reset(HashTable *table) {
+  memset(table->stats, 0, sizeof(struct ht_stats));
+}
+#else
+static inline bool stats_create(HashTable *table) {
+  (void)table;
+  return true;
+}
+static inline void stats_destroy(HashTable *table) { (void)table; }
+static inline uint64_t stats_clock(void) { return 0; }
+static inline void stats_begin_find(void) {}
+static inline void stats_end_find(const HashTable *table, hash_table_op op) {
+  (void)table;
+  (void)op;
+}
+static inline void stats_record_resize(const HashTable *table,
+                                       uint64_t start) {
+  (void)table;
+  (void)start;
+}
+static inline void stats_load(const HashTable *table,
+                              hash_table_stats *stats) {
+  (void)table;
+  (void)stats;
 }
+static inline void stats_reset(HashTable *table) { (void)table; }
+#endif
+
+static bool resize(HashTable *table, size_t new_capacity);
+static void finish_resize(HashTable *table);
 
 static void set_state(HashTable *table, size_t index, uint8_t state) {
   size_t byte_index = index / 4;
@@ -40,186 +141,1929 @@ static void set_state(HashTable *table, size_t index, uint8_t state) {
   table->control_bytes[byte_index] |= (state & 0b11) << bit_offset;
 }
 
-static size_t find_entry_index(const HashTable *table, const void *key,
-                               bool find_empty_for_insert) {
-  uint64_t hash = table->key_handler.hash(key);
-  size_t index = hash % table->capacity;
-  size_t tombstone_index = (size_t)-1;
+uint64_t ht_hash_key(const HashTable *table, const void *key) {
+  HT_STATS_ADD(table, hash_calls, 1);
+  return ht_hash_with(&table->key_handler, key, table->key_size, table->seed);
+}
 
-  for (;;) {
-    uint8_t state = get_state(table, index);
-    switch (state) {
-    case STATE_EMPTY:
-      return find_empty_for_insert && tombstone_index != (size_t)-1
-                 ? tombstone_index
-                 : index;
-    case STATE_DELETED:
-      if (find_empty_for_insert && tombstone_index == (size_t)-1) {
-        tombstone_index = index;
-      }
+// With cached hashes a mismatch is rejected without calling equal.
+// ht_linear_find_with() passes the match function one pointer, so linear
+// finds hand it the key together with the function comparing it.
+struct probe {
+  const void *key;
+  key_equal_function equal;
+};
+
+static bool probe_match(const HashTable *table, size_t index,
+                        const void *key, uint64_t hash) {
+  const struct probe *probe = key;
+  return (!table->hashes || table->hashes[index] == hash) &&
+         ht_key_equal(table, probe->equal, index, probe->key);
+}
+
+static size_t linear_find(const HashTable *table, const void *key,
+                          key_equal_function equal, uint64_t hash,
+                          size_t *insert_index) {
+  struct probe probe = {key, equal};
+  return ht_linear_find_with(table, &probe, hash, insert_index, probe_match);
+}
+
+// Insertion slot for a key known to be absent: the first slot that is not
+// occupied. During an in-place rehash that includes slots still marked for
+// rehashing, which hold HT_STATE_DELETED.
+static size_t linear_find_free(const HashTable *table, uint64_t hash) {
+  size_t mask = table->capacity - 1;
+  size_t index = hash & mask;
+  while (ht_linear_state(table, index) == HT_STATE_OCCUPIED) {
+    index = (index + 1) & mask;
+  }
+  return index;
+}
+
+static void linear_occupy(HashTable *table, size_t index) {
+  if (ht_linear_state(table, index) == HT_STATE_DELETED) {
+    table->tombstones--;
+  }
+  set_state(table, index, HT_STATE_OCCUPIED);
+}
+
+// A slot followed by an empty one ends every probe sequence that reaches
+// it, so it can become empty instead of a tombstone, and so can the run of
+// tombstones directly before it.
+static void linear_release(HashTable *table, size_t index) {
+  size_t mask = table->capacity - 1;
+  if (ht_linear_state(table, (index + 1) & mask) != HT_STATE_EMPTY) {
+    set_state(table, index, HT_STATE_DELETED);
+    table->tombstones++;
+    return;
+  }
+  set_state(table, index, HT_STATE_EMPTY);
+  for (index = (index - 1) & mask;
+       ht_linear_state(table, index) == HT_STATE_DELETED;
+       index = (index - 1) & mask) {
+    set_state(table, index, HT_STATE_EMPTY);
+    table->tombstones--;
+  }
+}
+
+static size_t linear_find_local(const HashTable *table, const void *key,
+                                key_equal_function equal, uint64_t hash,
+                                size_t end, size_t *insert_index) {
+  struct probe probe = {key, equal};
+  *insert_index = SLOT_NONE;
+  for (size_t index = hash & (table->capacity - 1); index < end; index++) {
+    if (ht_linear_state(table, index) == HT_STATE_EMPTY) {
+      *insert_index = index;
       break;
-    case STATE_OCCUPIED:
-      if (table->key_handler.equal(table->entries[index].key, key)) {
-        return index;
+    }
+    if (key && probe_match(table, index, &probe, hash))
+      return index;
+  }
+  return SLOT_NONE;
+}
+
+// Turns tombstones into empty slots and occupied slots into tombstones, the
+// starting point of rehash_in_place().
+static void linear_mark_for_rehash(HashTable *table) {
+  size_t control_size = (table->capacity + 3) / 4;
+  for (size_t i = 0; i < control_size; i++) {
+    uint8_t byte = table->control_bytes[i];
+    // Per 2-bit state: 01 (occupied) -> 10 (deleted), anything else -> 00.
+    table->control_bytes[i] = (byte & 0x55) << 1;
+  }
+}
+
+// Dispatch to the probing engine selected at creation.
+
+static size_t engine_control_size(const HashTable *table, size_t capacity) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_control_size(capacity);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return ht_robin_control_size(capacity);
+  default:
+    return (capacity + 3) / 4; // +3 to round up integer division
+  }
+}
+
+static void engine_init_control(const HashTable *table, uint8_t *control_bytes,
+                                size_t capacity) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    ht_swiss_init_control(control_bytes, capacity);
+    break;
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    ht_robin_init_control(control_bytes, capacity);
+    break;
+  default:
+    memset(control_bytes, 0, engine_control_size(table, capacity));
+    break;
+  }
+}
+
+// Slot where the probe sequence for hash starts.
+static size_t engine_home(const HashTable *table, uint64_t hash) {
+  if (table->engine == HASH_TABLE_ENGINE_SWISS)
+    return ht_swiss_home(table, hash);
+  if (table->frozen_buckets)
+    return ht_frozen_home(table, hash);
+  return hash & (table->capacity - 1);
+}
+
+static size_t engine_find(const HashTable *table, const void *key,
+                          key_equal_function equal, uint64_t hash,
+                          size_t *insert_index) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_find(table, key, equal, hash, insert_index);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    // Frozen tables are read-only, so nothing asks them for a free slot.
+    if (table->frozen_buckets)
+      return ht_robin_find_frozen(table, key, equal, hash);
+    return ht_robin_find(table, key, equal, hash, insert_index);
+  default:
+    return linear_find(table, key, equal, hash, insert_index);
+  }
+}
+
+static size_t engine_find_free(const HashTable *table, uint64_t hash) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_find_free(table, hash);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return ht_robin_find_free(table, hash);
+  default:
+    return linear_find_free(table, hash);
+  }
+}
+
+static size_t engine_find_local(const HashTable *table, const void *key,
+                                key_equal_function equal, uint64_t hash,
+                                size_t end, size_t *insert_index) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_find_local(table, key, equal, hash, insert_index);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return ht_robin_find_local(table, key, equal, hash, end, insert_index);
+  default:
+    return linear_find_local(table, key, equal, hash, end, insert_index);
+  }
+}
+
+// Only the Robin Hood engine can fail, when an entry would end up too far
+// from its home slot; the table then has to grow.
+static bool engine_occupy(HashTable *table, size_t index, uint64_t hash) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    ht_swiss_occupy(table, index, hash);
+    return true;
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return ht_robin_occupy(table, index, hash);
+  default:
+    linear_occupy(table, index);
+    return true;
+  }
+}
+
+static void engine_release(HashTable *table, size_t index) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    ht_swiss_release(table, index);
+    break;
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    ht_robin_release(table, index);
+    break;
+  default:
+    linear_release(table, index);
+    break;
+  }
+}
+
+static bool engine_is_occupied(const HashTable *table, size_t index) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_is_occupied(table, index);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return ht_robin_is_occupied(table, index);
+  default:
+    return ht_linear_state(table, index) == HT_STATE_OCCUPIED;
+  }
+}
+
+// The Robin Hood engine never leaves tombstones, so it never reaches the
+// in-place rehash that uses the three functions below.
+
+static bool engine_is_deleted(const HashTable *table, size_t index) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    return ht_swiss_is_deleted(table, index);
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    return false;
+  default:
+    return ht_linear_state(table, index) == HT_STATE_DELETED;
+  }
+}
+
+// Sets a slot straight to empty, without the tombstone bookkeeping of
+// engine_release().
+static void engine_clear(HashTable *table, size_t index) {
+  if (table->engine == HASH_TABLE_ENGINE_SWISS) {
+    ht_swiss_clear(table, index);
+  } else {
+    set_state(table, index, HT_STATE_EMPTY);
+  }
+}
+
+static void engine_mark_for_rehash(HashTable *table) {
+  if (table->engine == HASH_TABLE_ENGINE_SWISS) {
+    ht_swiss_mark_for_rehash(table);
+  } else {
+    linear_mark_for_rehash(table);
+  }
+}
+
+// Inline keys and values are copied with memcpy; pointer ones go through
+// the type handler.
+
+static void *copy_data(const HashTable *table, const type_handler *handler,
+                       const void *data) {
+  return ht_copy_with(handler, &table->alloc_handler, data);
+}
+
+void ht_destroy_data(const HashTable *table, const type_handler *handler,
+                     void *data) {
+  ht_destroy_with(handler, &table->alloc_handler, data);
+}
+
+static void store_key(HashTable *table, size_t index, const void *key) {
+  unsigned char *slot = ht_entry(table, index);
+  if (table->key_size) {
+    memcpy(slot, key, table->key_size);
+  } else {
+    *(void **)slot = copy_data(table, &table->key_handler, key);
+  }
+}
+
+// Stores data the table takes ownership of: inline bytes are still
+// copied, but a pointer is kept as it is.
+static void store_owned(unsigned char *slot, void *data, size_t inline_size) {
+  if (inline_size) {
+    memcpy(slot, data, inline_size);
+  } else {
+    *(void **)slot = data;
+  }
+}
+
+// Copies a slot's contents out to the caller: the inline bytes, or the
+// stored pointer.
+static void load_slot(void *out, const unsigned char *slot,
+                      size_t inline_size) {
+  memcpy(out, slot, inline_size ? inline_size : sizeof(void *));
+}
+
+static void store_value(HashTable *table, size_t index, const void *value) {
+  unsigned char *slot = ht_value_slot(table, index);
+  if (table->value_size) {
+    memcpy(slot, value, table->value_size);
+  } else {
+    *(void **)slot = copy_data(table, &table->value_handler, value);
+  }
+}
+
+static void destroy_value(HashTable *table, size_t index) {
+  if (!table->value_size)
+    ht_destroy_data(table, &table->value_handler, ht_entry_value(table, index));
+}
+
+// Whether destroying this side of an entry frees anything that a release
+// of the table's allocator would not.
+static bool needs_destroy(const HashTable *table, const type_handler *handler,
+                          size_t inline_size) {
+  if (inline_size)
+    return false;
+  if (handler->destroy_with_allocator)
+    return !table->alloc_handler.release;
+  return handler->destroy != NULL;
+}
+
+// Allocates empty slot arrays for new_capacity entries, including the hash
+// cache when the table keeps one. On failure nothing is left allocated.
+// Entries are zeroed only if zero_entries is set; free slots are never
+// read, so skipping it just leaves the pages untouched until used.
+static bool allocate_slots(const HashTable *table, size_t new_capacity,
+                           bool zero_entries, uint8_t **control_bytes,
+                           unsigned char **entries, uint64_t **hashes) {
+  size_t control_size = engine_control_size(table, new_capacity);
+  *control_bytes = ht_alloc(table, control_size);
+  if (!*control_bytes)
+    return false;
+  engine_init_control(table, *control_bytes, new_capacity);
+
+  size_t entries_size = ht_entries_size(table, new_capacity);
+  *entries = table->alloc_handler.alloc(
+      table->alloc_handler.ctx, entries_size,
+      table->separate_values ? VALUES_ALIGNMENT : ALLOC_ALIGNMENT);
+  if (!*entries) {
+    ht_free(table, *control_bytes, control_size);
+    return false;
+  }
+  if (zero_entries)
+    memset(*entries, 0, entries_size); // NULL pointers
+
+  *hashes = NULL;
+  if (table->cache_hashes) {
+    *hashes = ht_alloc(table, sizeof(uint64_t) * new_capacity);
+    if (!*hashes) {
+      ht_free(table, *entries, entries_size);
+      ht_free(table, *control_bytes, control_size);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Arrays that point into a snapshot mapping are not freed here; they go
+// away with the mapping when the table is destroyed.
+static void free_slots(const HashTable *table, size_t capacity,
+                       uint8_t *control_bytes, unsigned char *entries,
+                       uint64_t *hashes) {
+  unsigned char *mapping = table->mapping;
+  if (mapping && (unsigned char *)control_bytes >= mapping &&
+      (unsigned char *)control_bytes < mapping + table->mapping_size)
+    return;
+  ht_free(table, control_bytes, engine_control_size(table, capacity));
+  ht_free(table, entries, ht_entries_size(table, capacity));
+  if (hashes)
+    ht_free(table, hashes, sizeof(uint64_t) * capacity);
+}
+
+size_t ht_control_size(const HashTable *table, size_t capacity) {
+  return engine_control_size(table, capacity);
+}
+
+bool ht_is_occupied(const HashTable *table, size_t index) {
+  return engine_is_occupied(table, index);
+}
+
+void ht_set_slots(HashTable *table, size_t capacity, uint8_t *control_bytes,
+                  unsigned char *entries, uint64_t *hashes) {
+  free_slots(table, table->capacity, table->control_bytes, table->entries,
+             table->hashes);
+  table->capacity = capacity;
+  table->control_bytes = control_bytes;
+  ht_set_entries(table, entries, capacity);
+  table->hashes = hashes;
+}
+
+// Parallel resize and bulk build. The new arrays are split into regions:
+// runs of consecutive slots, a multiple of 64 long so that no LINEAR
+// control byte or SWISS group is shared by two of them. Entries are first
+// grouped by the region of their home slot, then every region is filled by
+// one thread at a time, with probes that stay inside it. The few entries
+// whose probe would leave their region are added on the calling thread at
+// the end, in the order they came in.
+
+// Below this many entries starting the threads costs more than it saves.
+#define PARALLEL_MIN_ENTRIES 65536
+#define MAX_FILL_THREADS 256
+#define REGION_MIN_SLOTS 4096
+// More regions than threads keeps threads that finish early busy.
+#define REGIONS_PER_THREAD 8
+
+struct parallel_fill {
+  HashTable *table;
+  // The arrays entries are moved from, or NULL to build from keys and
+  // values.
+  const HashTable *old;
+  const void *const *keys;
+  const void *const *values;
+  size_t items; // old->capacity, or the number of keys
+  size_t threads;
+  size_t regions;
+  unsigned region_shift; // log2 of the slots per region
+  uint64_t *hashes;      // one per item, or old->hashes
+  // counts[t * regions + r] is the number of thread t's items that belong
+  // in region r, and then where in order the first of them goes.
+  size_t *counts;
+  size_t *region_start; // regions + 1 offsets into order
+  size_t *order;        // item indices, grouped by region
+  // Per region, the items left for the calling thread, which are moved to
+  // the start of the region's part of order.
+  size_t *deferred;
+  _Atomic size_t next_region;
+};
+
+struct fill_worker {
+  struct parallel_fill *fill;
+  size_t id;
+  size_t added; // entries this worker added to the table
+  void (*run)(struct fill_worker *worker);
+  pthread_t thread;
+  bool started;
+};
+
+static bool fill_has_item(const struct parallel_fill *fill, size_t i) {
+  return !fill->old || engine_is_occupied(fill->old, i);
+}
+
+static size_t fill_region(const struct parallel_fill *fill, uint64_t hash) {
+  return engine_home(fill->table, hash) >> fill->region_shift;
+}
+
+// The items of one worker's share, [*first, *last).
+static void fill_share(const struct parallel_fill *fill, size_t id,
+                       size_t *first, size_t *last) {
+  size_t share = (fill->items + fill->threads - 1) / fill->threads;
+  *first = id * share < fill->items ? id * share : fill->items;
+  *last = fill->items - *first < share ? fill->items : *first + share;
+}
+
+static void fill_count(struct fill_worker *worker) {
+  struct parallel_fill *fill = worker->fill;
+  size_t *counts = fill->counts + worker->id * fill->regions;
+  bool cached = fill->old && fill->old->hashes;
+  size_t first, last;
+  fill_share(fill, worker->id, &first, &last);
+  for (size_t i = first; i < last; i++) {
+    if (!fill_has_item(fill, i))
+      continue;
+    if (!cached) {
+      const void *key =
+          fill->old ? ht_entry_key(fill->old, i) : fill->keys[i];
+      fill->hashes[i] = ht_hash_key(fill->table, key);
+    }
+    counts[fill_region(fill, fill->hashes[i])]++;
+  }
+}
+
+static void fill_scatter(struct fill_worker *worker) {
+  struct parallel_fill *fill = worker->fill;
+  size_t *next = fill->counts + worker->id * fill->regions;
+  size_t first, last;
+  fill_share(fill, worker->id, &first, &last);
+  for (size_t i = first; i < last; i++) {
+    if (fill_has_item(fill, i))
+      fill->order[next[fill_region(fill, fill->hashes[i])]++] = i;
+  }
+}
+
+// Adds item i without probing at or past slot end. Returns false if it
+// has to be left for the calling thread.
+static bool fill_place(struct fill_worker *worker, size_t i, size_t end) {
+  struct parallel_fill *fill = worker->fill;
+  HashTable *table = fill->table;
+  uint64_t hash = fill->hashes[i];
+  const void *key = fill->old ? NULL : fill->keys[i];
+  size_t index;
+  size_t found = engine_find_local(table, key, table->key_handler.equal,
+                                   hash, end, &index);
+  if (found != SLOT_NONE) {
+    // A repeated key: as with hash_table_insert(), the later value wins.
+    destroy_value(table, found);
+    store_value(table, found, fill->values[i]);
+    return true;
+  }
+  if (index == SLOT_NONE || !engine_occupy(table, index, hash))
+    return false;
+  if (fill->old) {
+    ht_copy_entry(table, index, fill->old, i);
+  } else {
+    store_key(table, index, key);
+    store_value(table, index, fill->values[i]);
+  }
+  if (table->hashes)
+    table->hashes[index] = hash;
+  worker->added++;
+  return true;
+}
+
+static void fill_regions(struct fill_worker *worker) {
+  struct parallel_fill *fill = worker->fill;
+  HashTable *table = fill->table;
+  size_t r;
+  while ((r = atomic_fetch_add_explicit(&fill->next_region, 1,
+                                        memory_order_relaxed)) <
+         fill->regions) {
+    size_t start = r << fill->region_shift;
+    size_t end = start + ((size_t)1 << fill->region_shift);
+    // A resize leaves the new entries unzeroed, so that the thread filling
+    // a region is also the first to touch its pages.
+    if (fill->old) {
+      memset(ht_entry(table, start), 0, (end - start) * table->entry_size);
+      if (table->separate_values)
+        memset(ht_value_slot(table, start), 0,
+               (end - start) * table->value_stride);
+    }
+    size_t kept = fill->region_start[r];
+    for (size_t k = fill->region_start[r]; k < fill->region_start[r + 1];
+         k++) {
+      size_t i = fill->order[k];
+      if (!fill_place(worker, i, end))
+        fill->order[kept++] = i;
+    }
+    fill->deferred[r] = kept - fill->region_start[r];
+  }
+}
+
+static void *fill_thread(void *arg) {
+  struct fill_worker *worker = arg;
+  worker->run(worker);
+  return NULL;
+}
+
+// Runs one phase on every worker, the first of them on the calling thread.
+// A worker whose thread cannot be started runs there as well, afterwards.
+static void run_workers(struct fill_worker *workers, size_t n,
+                        void (*run)(struct fill_worker *worker)) {
+  for (size_t t = 1; t < n; t++) {
+    workers[t].run = run;
+    workers[t].started = pthread_create(&workers[t].thread, NULL,
+                                        fill_thread, &workers[t]) == 0;
+  }
+  run(&workers[0]);
+  for (size_t t = 1; t < n; t++) {
+    if (workers[t].started) {
+      pthread_join(workers[t].thread, NULL);
+    } else {
+      run(&workers[t]);
+    }
+  }
+}
+
+// Adds the entries of old, or the n = items pairs of keys and values, to
+// table, whose arrays are new and empty, on up to threads threads.
+// Returns false if the scratch arrays cannot be allocated or an entry
+// cannot be placed, which only happens with the Robin Hood engine; the
+// table may then hold some of the entries.
+static bool fill_parallel(HashTable *table, const HashTable *old,
+                          const void *const *keys, const void *const *values,
+                          size_t items, size_t threads) {
+  struct parallel_fill fill = {.table = table,
+                               .old = old,
+                               .keys = keys,
+                               .values = values,
+                               .items = items,
+                               .threads = threads < MAX_FILL_THREADS
+                                              ? threads
+                                              : MAX_FILL_THREADS,
+                               .regions = 1};
+  while (fill.regions < fill.threads * REGIONS_PER_THREAD)
+    fill.regions *= 2;
+  while (fill.regions > 1 && table->capacity / fill.regions < REGION_MIN_SLOTS)
+    fill.regions /= 2;
+  while (((size_t)1 << fill.region_shift) < table->capacity / fill.regions)
+    fill.region_shift++;
+  atomic_init(&fill.next_region, 0);
+
+  size_t entries = old ? old->count : items;
+  struct fill_worker *workers = calloc(fill.threads, sizeof(*workers));
+  fill.counts = calloc(fill.threads * fill.regions, sizeof(size_t));
+  fill.region_start = malloc(sizeof(size_t) * (fill.regions + 1));
+  fill.deferred = malloc(sizeof(size_t) * fill.regions);
+  fill.order = malloc(sizeof(size_t) * (entries ? entries : 1));
+  bool own_hashes = !old || !old->hashes;
+  fill.hashes = own_hashes ? malloc(sizeof(uint64_t) * items) : old->hashes;
+  bool ok = workers && fill.counts && fill.region_start && fill.deferred &&
+            fill.order && fill.hashes;
+
+  if (ok) {
+    for (size_t t = 0; t < fill.threads; t++)
+      workers[t] = (struct fill_worker){.fill = &fill, .id = t};
+    run_workers(workers, fill.threads, fill_count);
+    // Each region's part of order holds its items in item order: first
+    // thread 0's share, then thread 1's, and so on.
+    size_t offset = 0;
+    for (size_t r = 0; r < fill.regions; r++) {
+      fill.region_start[r] = offset;
+      for (size_t t = 0; t < fill.threads; t++) {
+        size_t count = fill.counts[t * fill.regions + r];
+        fill.counts[t * fill.regions + r] = offset;
+        offset += count;
       }
-      break;
     }
-    index = (index + 1) % table->capacity;
+    fill.region_start[fill.regions] = offset;
+    run_workers(workers, fill.threads, fill_scatter);
+    run_workers(workers, fill.threads, fill_regions);
+    for (size_t t = 0; t < fill.threads; t++)
+      table->count += workers[t].added;
   }
+
+  for (size_t r = 0; ok && r < fill.regions; r++) {
+    for (size_t k = fill.region_start[r];
+         ok && k < fill.region_start[r] + fill.deferred[r]; k++) {
+      size_t i = fill.order[k];
+      uint64_t hash = fill.hashes[i];
+      if (!old) {
+        ok = ht_insert_hashed(table, keys[i], hash, values[i]);
+        continue;
+      }
+      size_t index = engine_find_free(table, hash);
+      ok = index != SLOT_NONE && engine_occupy(table, index, hash);
+      if (ok) {
+        ht_copy_entry(table, index, old, i);
+        if (table->hashes)
+          table->hashes[index] = hash;
+        table->count++;
+      }
+    }
+  }
+
+  free(workers);
+  free(fill.counts);
+  free(fill.region_start);
+  free(fill.deferred);
+  free(fill.order);
+  if (own_hashes)
+    free(fill.hashes);
+  return ok;
+}
+
+// Entries are moved rather than re-inserted: the new array holds no
+// tombstones or duplicates, so no handler calls or equality checks are
+// needed, only a probe for the first free slot.
+static bool move_entries(HashTable *table, const HashTable *old) {
+  for (size_t i = 0; i < old->capacity; i++) {
+    if (engine_is_occupied(old, i)) {
+      uint64_t hash = old->hashes ? old->hashes[i]
+                                  : ht_hash_key(table, ht_entry_key(old, i));
+      size_t index = engine_find_free(table, hash);
+      if (index == SLOT_NONE || !engine_occupy(table, index, hash))
+        return false;
+      ht_copy_entry(table, index, old, i);
+      if (table->hashes)
+        table->hashes[index] = hash;
+      table->count++;
+    }
+  }
+  return true;
 }
 
 static bool resize(HashTable *table, size_t new_capacity) {
-  struct InternalEntry *old_entries = table->entries;
-  uint8_t *old_control_bytes = table->control_bytes;
-  size_t old_capacity = table->capacity;
+  finish_resize(table);
+  const HashTable old = *table;
+  uint64_t start = stats_clock();
+  bool parallel =
+      table->resize_threads > 1 && old.count >= PARALLEL_MIN_ENTRIES;
 
-  size_t control_size = (new_capacity + 3) / 4;
-  uint8_t *new_control_bytes = table->alloc_handler.alloc(control_size);
-  if (!new_control_bytes)
+  uint8_t *new_control_bytes;
+  unsigned char *new_entries;
+  uint64_t *new_hashes;
+  if (!allocate_slots(table, new_capacity, !parallel, &new_control_bytes,
+                      &new_entries, &new_hashes))
     return false;
-  memset(new_control_bytes, 0, control_size);
 
-  struct InternalEntry *new_entries =
-      table->alloc_handler.alloc(sizeof(struct InternalEntry) * new_capacity);
-  if (!new_entries) {
-    table->alloc_handler.free(new_control_bytes);
+  ht_set_entries(table, new_entries, new_capacity);
+  table->control_bytes = new_control_bytes;
+  table->hashes = new_hashes;
+  table->capacity = new_capacity;
+  table->count = 0;
+  table->tombstones = 0;
+
+  bool moved = parallel ? fill_parallel(table, &old, NULL, NULL, old.capacity,
+                                        table->resize_threads)
+                        : move_entries(table, &old);
+  if (!moved) {
+    // The old arrays are untouched until the end, so the new ones can
+    // simply be dropped and the table left as it was.
+    free_slots(table, new_capacity, new_control_bytes, new_entries,
+               new_hashes);
+    *table = old;
     return false;
   }
 
-  for (size_t i = 0; i < new_capacity; i++) {
-    new_entries[i].key = NULL;
-    new_entries[i].value = NULL;
+  free_slots(table, old.capacity, old.control_bytes, old.entries, old.hashes);
+  stats_record_resize(table, start);
+  return true;
+}
+
+// Starts an incremental resize: the current arrays move to old_table and
+// empty ones of new_capacity take their place. Entries are moved over
+// later by migrate().
+static bool start_resize(HashTable *table, size_t new_capacity) {
+  uint64_t start = stats_clock();
+  HashTable *old = ht_alloc(table, sizeof(HashTable));
+  if (!old)
+    return false;
+  uint8_t *new_control_bytes;
+  unsigned char *new_entries;
+  uint64_t *new_hashes;
+  // Zeroing hundreds of megabytes up front would bring back the pause.
+  if (!allocate_slots(table, new_capacity, false, &new_control_bytes,
+                      &new_entries, &new_hashes)) {
+    ht_free(table, old, sizeof(HashTable));
+    return false;
   }
 
-  table->entries = new_entries;
+  *old = *table;
   table->control_bytes = new_control_bytes;
+  ht_set_entries(table, new_entries, new_capacity);
+  table->hashes = new_hashes;
   table->capacity = new_capacity;
   table->count = 0;
+  table->tombstones = 0;
+  table->old_table = old;
+  table->migrate_index = 0;
+  stats_record_resize(table, start);
+  return true;
+}
+
+// Moves the entry in slot i of old_table into the current arrays, which
+// always have room for it (see RESIZE_STEP).
+static void migrate_slot(HashTable *table, size_t i) {
+  HashTable *old = table->old_table;
+  uint64_t hash =
+      old->hashes ? old->hashes[i] : ht_hash_key(table, ht_entry_key(old, i));
+  size_t index = engine_find_free(table, hash);
+  engine_occupy(table, index, hash);
+  ht_copy_entry(table, index, old, i);
+  if (table->hashes)
+    table->hashes[index] = hash;
+  table->count++;
+
+  // Releasing keeps old_table's probe sequences intact for lookups of the
+  // entries that have not moved yet.
+  ht_clear_entry(old, i);
+  engine_release(old, i);
+  old->count--;
+}
+
+// Moves the entries of up to max_slots slots of old_table, and frees its
+// arrays once it is empty.
+static void migrate(HashTable *table, size_t max_slots) {
+  HashTable *old = table->old_table;
+  size_t end = old->capacity - table->migrate_index < max_slots
+                   ? old->capacity
+                   : table->migrate_index + max_slots;
+  for (; table->migrate_index < end && old->count > 0; table->migrate_index++) {
+    if (engine_is_occupied(old, table->migrate_index))
+      migrate_slot(table, table->migrate_index);
+  }
+  if (old->count == 0) {
+    free_slots(old, old->capacity, old->control_bytes, old->entries,
+               old->hashes);
+    ht_free(table, old, sizeof(HashTable));
+    table->old_table = NULL;
+  }
+}
+
+static void finish_resize(HashTable *table) {
+  if (table->old_table)
+    migrate(table, SIZE_MAX);
+}
+
+// Finds key, compared by equal, in whichever arrays hold it during an
+// incremental resize. *arrays receives the table or its old_table.
+static size_t find_entry(const HashTable *table, const void *key,
+                         key_equal_function equal, uint64_t hash,
+                         hash_table_op op, HashTable **arrays) {
+  stats_begin_find();
+  *arrays = (HashTable *)table;
+  size_t index = table->count > 0
+                     ? engine_find(table, key, equal, hash, NULL)
+                     : SLOT_NONE;
+  if (index == SLOT_NONE && table->old_table) {
+    *arrays = table->old_table;
+    index = engine_find(table->old_table, key, equal, hash, NULL);
+  }
+  stats_end_find(table, op);
+  return index;
+}
+
+static void swap_bytes(unsigned char *x, unsigned char *y, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    unsigned char tmp = x[i];
+    x[i] = y[i];
+    y[i] = tmp;
+  }
+}
 
-  for (size_t i = 0; i < old_capacity; i++) {
-    if (get_state(&(const HashTable){.control_bytes = old_control_bytes}, i) ==
-        STATE_OCCUPIED) {
-      hash_table_insert(table, old_entries[i].key, old_entries[i].value);
+static void swap_entries(HashTable *table, size_t a, size_t b) {
+  swap_bytes(ht_entry(table, a), ht_entry(table, b), table->entry_size);
+  if (table->separate_values)
+    swap_bytes(ht_value_slot(table, a), ht_value_slot(table, b),
+               table->value_stride);
+  if (table->hashes) {
+    uint64_t tmp = table->hashes[a];
+    table->hashes[a] = table->hashes[b];
+    table->hashes[b] = tmp;
+  }
+}
 
-      table->key_handler.destroy(old_entries[i].key);
-      table->value_handler.destroy(old_entries[i].value);
+// Drops every tombstone without changing capacity or allocating. All
+// entries are first marked as tombstones, then each one is moved to the
+// first free slot of its probe sequence. A slot that is already finalized
+// is never moved again, so every probe sequence that led to it stays
+// intact. When the target still holds an unprocessed entry the two are
+// swapped and the displaced entry is placed next.
+static void rehash_in_place(HashTable *table) {
+  HT_STATS_ADD(table, rehashes, 1);
+  engine_mark_for_rehash(table);
+  // Every marked slot is counted as a tombstone so that engine_occupy()
+  // brings the count back to zero as entries are finalized.
+  table->tombstones = table->count;
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    while (engine_is_deleted(table, i)) {
+      uint64_t hash = table->hashes
+                          ? table->hashes[i]
+                          : ht_hash_key(table, ht_entry_key(table, i));
+      size_t target = engine_find_free(table, hash);
+      if (target == i) {
+        engine_occupy(table, i, hash);
+        break;
+      }
+
+      bool target_pending = engine_is_deleted(table, target);
+      engine_occupy(table, target, hash);
+      if (target_pending) {
+        // Swap, then process the displaced entry next.
+        swap_entries(table, i, target);
+      } else {
+        ht_move_entry(table, target, i);
+        engine_clear(table, i);
+        table->tombstones--;
+        ht_clear_entry(table, i);
+      }
     }
   }
+}
 
-  table->alloc_handler.free(old_entries);
-  table->alloc_handler.free(old_control_bytes);
-  return true;
+// Capacity for entries at the table's load factor, or 0 if none fits.
+static size_t capacity_for(const HashTable *table, size_t entries) {
+  return ht_capacity_for(entries, INITIAL_CAPACITY, table->max_load_factor);
+}
+
+// Load a bounded table is created to hold: max_entries plus enough
+// tombstones that make_room() rehashes in place rather than grows, even
+// while the table is full.
+static size_t bounded_load(size_t max_entries) {
+  return max_entries + max_entries / 3 + 2;
+}
+
+// Called before inserting a new entry. Tombstones count towards the load
+// factor because they lengthen probes just like live entries. When most of
+// the load is tombstones the table is rehashed in place rather than grown.
+static bool make_room(HashTable *table) {
+  double limit = table->capacity * table->max_load_factor;
+  if (table->count + table->tombstones + 1 <= limit)
+    return true;
+  if (table->old_table) {
+    finish_resize(table);
+    if (table->count + table->tombstones + 1 <= limit)
+      return true;
+  }
+  if (table->tombstones > 0 && table->count + 1 <= limit * 0.75) {
+    rehash_in_place(table);
+    return true;
+  }
+  if (table->incremental_resize)
+    return start_resize(table, table->capacity * 2);
+  return resize(table, table->capacity * 2);
 }
 
 HashTable *hash_table_create(type_handler key_handler,
                              type_handler value_handler,
                              allocator *custom_allocator) {
-  allocator alloc_h = {
-      custom_allocator ? custom_allocator->alloc : default_alloc,
-      custom_allocator ? custom_allocator->free : default_free};
+  return hash_table_create_with_options(key_handler, value_handler,
+                                        custom_allocator, NULL);
+}
 
-  HashTable *table = alloc_h.alloc(sizeof(HashTable));
-  if (!table)
+HashTable *hash_table_create_with_options(type_handler key_handler,
+                                          type_handler value_handler,
+                                          allocator *custom_allocator,
+                                          const hash_table_options *options) {
+  hash_table_options opts = options ? *options : (hash_table_options){0};
+  if (opts.engine != HASH_TABLE_ENGINE_LINEAR &&
+      opts.engine != HASH_TABLE_ENGINE_SWISS &&
+      opts.engine != HASH_TABLE_ENGINE_ROBIN_HOOD)
+    return NULL;
+  if (!ht_load_factor_valid(opts.max_load_factor))
     return NULL;
 
+  HashTable *table;
+  if (opts.allocator) {
+    table = opts.allocator->alloc(opts.allocator->ctx, sizeof(HashTable),
+                                  ALLOC_ALIGNMENT);
+    if (!table)
+      return NULL;
+    table->alloc_handler = *opts.allocator;
+  } else if (custom_allocator) {
+    table = custom_allocator->alloc(sizeof(HashTable));
+    if (!table)
+      return NULL;
+    table->legacy_allocator = *custom_allocator;
+    table->alloc_handler = (context_allocator){
+        legacy_alloc, legacy_free, NULL, &table->legacy_allocator};
+  } else {
+    table = default_alloc(NULL, sizeof(HashTable), ALLOC_ALIGNMENT);
+    if (!table)
+      return NULL;
+    table->alloc_handler = ht_default_allocator();
+  }
+
   table->key_handler = key_handler;
   table->value_handler = value_handler;
-  table->alloc_handler = alloc_h;
-  table->capacity = INITIAL_CAPACITY;
-  table->count = 0;
-
-  size_t control_size =
-      (table->capacity + 3) / 4; // +3 to round up integer division
-  table->control_bytes = alloc_h.alloc(control_size);
-  if (!table->control_bytes) {
-    alloc_h.free(table);
+  table->engine = opts.engine;
+  table->max_load_factor = opts.max_load_factor;
+  if (table->max_load_factor == 0) {
+    switch (opts.engine) {
+    case HASH_TABLE_ENGINE_SWISS:
+      table->max_load_factor = SWISS_MAX_LOAD_FACTOR;
+      break;
+    case HASH_TABLE_ENGINE_ROBIN_HOOD:
+      table->max_load_factor = ROBIN_HOOD_MAX_LOAD_FACTOR;
+      break;
+    default:
+      table->max_load_factor = MAX_LOAD_FACTOR;
+      break;
+    }
+  }
+  table->cache_hashes = opts.cache_hashes;
+  table->resize_threads = opts.resize_threads;
+  table->seed = opts.seed;
+  table->key_size = opts.key_size;
+  table->value_size = opts.value_size;
+  size_t key_slot = opts.key_size ? opts.key_size : sizeof(void *);
+  size_t value_slot = opts.value_size ? opts.value_size : sizeof(void *);
+  table->value_offset = ht_align_up(key_slot, INLINE_ALIGNMENT);
+  table->bounded = opts.max_entries || opts.max_bytes;
+  table->meta_offset = table->value_offset;
+  if (table->bounded)
+    table->value_offset +=
+        ht_align_up(sizeof(struct ht_entry_meta), INLINE_ALIGNMENT);
+  table->expiry = opts.expiry;
+  table->deadline_offset = table->value_offset;
+  if (opts.expiry)
+    table->value_offset += ht_align_up(sizeof(uint32_t), INLINE_ALIGNMENT);
+  table->separate_values = opts.separate_values;
+  if (opts.separate_values) {
+    table->entry_size = table->value_offset;
+    table->value_stride = ht_align_up(value_slot, INLINE_ALIGNMENT);
+  } else {
+    table->entry_size =
+        ht_align_up(table->value_offset + value_slot, INLINE_ALIGNMENT);
+    table->value_stride = table->entry_size;
+  }
+  size_t initial_capacity = opts.initial_capacity;
+  if (opts.max_entries && initial_capacity < bounded_load(opts.max_entries))
+    initial_capacity = bounded_load(opts.max_entries);
+  table->capacity = capacity_for(table, initial_capacity);
+  if (table->capacity == 0) {
+    ht_free(table, table, sizeof(HashTable));
     return NULL;
   }
-  memset(table->control_bytes, 0, control_size); // All slots are STATE_EMPTY
+  table->count = 0;
+  table->tombstones = 0;
+  table->incremental_resize = opts.incremental_resize &&
+                              opts.engine != HASH_TABLE_ENGINE_ROBIN_HOOD &&
+                              !table->bounded;
+  table->old_table = NULL;
+  table->migrate_index = 0;
+  table->mapping = NULL;
+  table->mapping_size = 0;
+  table->read_only = false;
+  table->frozen_buckets = 0;
+  table->max_entries = opts.max_entries;
+  table->max_bytes = opts.max_bytes;
+  table->bytes = 0;
+  table->entry_bytes = opts.entry_bytes;
+  table->on_evict = opts.on_evict;
+  table->evict_ctx = opts.evict_ctx;
+  table->clock_hand = 0;
+  table->evictions = 0;
+  table->expiry_clock = opts.expiry_clock;
+  table->expiry_ctx = opts.expiry_ctx;
+  table->expire_cursor = 0;
+  table->expirations = 0;
 
-  table->entries =
-      alloc_h.alloc(sizeof(struct InternalEntry) * table->capacity);
-  if (!table->entries) {
-    alloc_h.free(table->control_bytes);
-    alloc_h.free(table);
+  unsigned char *entries;
+  if (!allocate_slots(table, table->capacity, true, &table->control_bytes,
+                      &entries, &table->hashes)) {
+    ht_free(table, table, sizeof(HashTable));
     return NULL;
   }
-
-  for (size_t i = 0; i < table->capacity; i++) {
-    table->entries[i].key = NULL;
-    table->entries[i].value = NULL;
+  ht_set_entries(table, entries, table->capacity);
+  if (!stats_create(table)) {
+    free_slots(table, table->capacity, table->control_bytes, table->entries,
+               table->hashes);
+    ht_free(table, table, sizeof(HashTable));
+    return NULL;
   }
 
   return table;
 }
 
+// Destroys the entries of one set of slot arrays and frees the arrays.
+static void destroy_slots(HashTable *arrays) {
+  bool destroy_keys =
+      needs_destroy(arrays, &arrays->key_handler, arrays->key_size);
+  bool destroy_values =
+      needs_destroy(arrays, &arrays->value_handler, arrays->value_size);
+  if (destroy_keys || destroy_values) {
+    for (size_t i = 0; i < arrays->capacity; i++) {
+      if (!engine_is_occupied(arrays, i))
+        continue;
+      if (destroy_keys)
+        ht_destroy_data(arrays, &arrays->key_handler, ht_entry_key(arrays, i));
+      if (destroy_values)
+        ht_destroy_data(arrays, &arrays->value_handler,
+                        ht_entry_value(arrays, i));
+    }
+  }
+  free_slots(arrays, arrays->capacity, arrays->control_bytes, arrays->entries,
+             arrays->hashes);
+}
+
 void hash_table_destroy(HashTable *table) {
   if (!table)
     return;
-  for (size_t i = 0; i < table->capacity; i++) {
-    if (get_state(table, i) == STATE_OCCUPIED) {
-      table->key_handler.destroy(table->entries[i].key);
-      table->value_handler.destroy(table->entries[i].value);
+  if (table->old_table) {
+    destroy_slots(table->old_table);
+    ht_free(table, table->old_table, sizeof(HashTable));
+  }
+  destroy_slots(table);
+  if (table->mapping)
+    ht_unmap_snapshot(table);
+  stats_destroy(table);
+
+  context_allocator alloc_h = table->alloc_handler;
+  if (alloc_h.release) {
+    alloc_h.release(alloc_h.ctx);
+  } else {
+    alloc_h.free(alloc_h.ctx, table, sizeof(HashTable));
+  }
+}
+
+// The slot get_or_insert and upsert hand out: the inline value bytes, or
+// the stored value pointer itself.
+static void *value_slot(const HashTable *arrays, size_t index) {
+  return ht_value_slot(arrays, index);
+}
+
+// Bounded tables. Each entry's struct ht_entry_meta holds its CLOCK
+// reference flag and its charge towards max_bytes.
+
+static size_t entry_charge(const HashTable *table, const void *key,
+                           const void *value) {
+  if (!table->bounded)
+    return 0;
+  if (table->entry_bytes)
+    return table->entry_bytes(key, value);
+  return table->entry_size + (table->separate_values ? table->value_stride : 0);
+}
+
+// Records the charge of the entry in slot index, replacing its previous
+// one. Entries that were just added must have a zeroed meta.
+static void set_charge(HashTable *table, size_t index, size_t charge) {
+  struct ht_entry_meta *meta = ht_entry_meta(table, index);
+  uint32_t clamped = charge < UINT32_MAX ? (uint32_t)charge : UINT32_MAX;
+  table->bytes = table->bytes - meta->charge + clamped;
+  meta->charge = clamped;
+}
+
+// Gives the entry in slot index a second chance against eviction. The
+// flag is only written when clear, so that threads hitting a hot entry
+// under a reader lock do not keep taking its cache line from each other.
+static void mark_referenced(const HashTable *arrays, size_t index) {
+  if (!arrays->bounded)
+    return;
+  _Atomic uint8_t *referenced = &ht_entry_meta(arrays, index)->referenced;
+  if (!atomic_load_explicit(referenced, memory_order_relaxed))
+    atomic_store_explicit(referenced, 1, memory_order_relaxed);
+}
+
+// Taken by the reference flag of an entry the clock hand must pass over.
+// mark_referenced() leaves it alone, since it is not clear.
+#define CLOCK_PINNED 2
+
+// Advances the clock hand to the first entry that has not been referenced
+// since the hand last passed it, clearing the flags on the way, and evicts
+// it. The table must not be empty.
+static void evict_one(HashTable *table) {
+  for (;;) {
+    size_t index =
+        (table->clock_hand++ * CLOCK_STRIDE) & (table->capacity - 1);
+    if (!engine_is_occupied(table, index))
+      continue;
+    _Atomic uint8_t *referenced = &ht_entry_meta(table, index)->referenced;
+    uint8_t flag = atomic_load_explicit(referenced, memory_order_relaxed);
+    if (flag == CLOCK_PINNED)
+      continue;
+    if (flag) {
+      atomic_store_explicit(referenced, 0, memory_order_relaxed);
+      continue;
     }
+    if (table->on_evict)
+      table->on_evict(ht_entry_key(table, index),
+                      ht_entry_value(table, index), table->evict_ctx);
+    ht_erase(table, index);
+    table->evictions++;
+    return;
   }
-  table->alloc_handler.free(table->control_bytes);
-  table->alloc_handler.free(table->entries);
-  table->alloc_handler.free(table);
 }
 
-bool hash_table_insert(HashTable *table, void *key, void *value) {
-  if (table->count + 1 > table->capacity * MAX_LOAD_FACTOR) {
-    if (!resize(table, table->capacity * 2)) {
-      return false;
+// Evicts entries until `entries` more entries charged charge in total fit
+// within the table's bounds. Returns false, evicting nothing, if they
+// never can.
+static bool evict_for(HashTable *table, size_t entries, size_t charge) {
+  if (table->max_bytes && charge > table->max_bytes)
+    return false;
+  while (table->count > 0 &&
+         ((table->max_entries &&
+           table->count + entries > table->max_entries) ||
+          (table->max_bytes && table->bytes + charge > table->max_bytes)))
+    evict_one(table);
+  return true;
+}
+
+// Charges key's updated entry in slot index charge, then evicts what no
+// longer fits. The entry is pinned meanwhile, so an update never evicts
+// the entry it wrote; it fits on its own since find_or_add() refuses
+// larger charges. Bounded tables never resize incrementally, so the
+// entry is in table's own arrays.
+static void recharge(HashTable *table, size_t index, size_t charge,
+                     const void *key, uint64_t hash) {
+  set_charge(table, index, charge);
+  _Atomic uint8_t *referenced = &ht_entry_meta(table, index)->referenced;
+  atomic_store_explicit(referenced, CLOCK_PINNED, memory_order_relaxed);
+  uint64_t evictions = table->evictions;
+  evict_for(table, 0, 0);
+  // Evictions release slots, which may move entries.
+  if (table->evictions != evictions) {
+    index = engine_find(table, key, table->key_handler.equal, hash, NULL);
+    referenced = &ht_entry_meta(table, index)->referenced;
+  }
+  atomic_store_explicit(referenced, 1, memory_order_relaxed);
+}
+
+// Tables with expiry. A deadline is the low 32 bits of the clock, compared
+// modulo 2^32 so that the clock may start anywhere; 0 means none.
+
+static uint32_t expiry_now(const HashTable *table) {
+  if (table->expiry_clock)
+    return (uint32_t)table->expiry_clock(table->expiry_ctx);
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint32_t)ts.tv_sec;
+}
+
+static bool deadline_passed(uint32_t deadline, uint32_t now) {
+  return deadline != 0 && (int32_t)(deadline - now) <= 0;
+}
+
+// Whether the entry in slot index has expired. Only entries with a
+// deadline read the clock.
+static bool expired(const HashTable *arrays, size_t index) {
+  if (!arrays->expiry)
+    return false;
+  uint32_t deadline = *ht_entry_deadline(arrays, index);
+  return deadline != 0 && deadline_passed(deadline, expiry_now(arrays));
+}
+
+// Reclaims an entry found expired, in either set of arrays.
+static void reclaim_expired(HashTable *table, HashTable *arrays,
+                            size_t index) {
+  ht_erase(arrays, index);
+  table->expirations++;
+}
+
+// Occupies the free slot index found for hash, or SLOT_NONE if there was
+// none. Returns the slot to use, or SLOT_NONE if the key cannot be added.
+static size_t claim_slot(HashTable *table, size_t index, uint64_t hash) {
+  while (index == SLOT_NONE || !engine_occupy(table, index, hash)) {
+    // Only an over-long Robin Hood probe gets here. Growing helps while
+    // the table is reasonably full; in a sparse table it means too many
+    // keys share a hash and the insert is refused.
+    if (table->count < table->capacity * table->max_load_factor / 2 ||
+        !resize(table, table->capacity * 2)) {
+      return SLOT_NONE;
     }
+    index = engine_find_free(table, hash);
   }
+  return index;
+}
 
-  size_t index = find_entry_index(table, key, true);
-  struct InternalEntry *entry = &table->entries[index];
+// Single probe shared by the insert functions. Returns the slot holding
+// key, in the arrays stored to *arrays, after adding the key with an
+// all-zero value slot if it was missing. A key that is added is copied,
+// or with owned_key stored as passed, and in a bounded table charged
+// charge after evicting what it takes to fit it. Returns SLOT_NONE if
+// there is no room for it.
+static size_t find_or_add(HashTable *table, const void *key, uint64_t hash,
+                          bool owned_key, size_t charge, HashTable **arrays,
+                          bool *inserted) {
+  if (table->read_only ||
+      (table->max_bytes && charge > table->max_bytes))
+    return SLOT_NONE;
+  if (table->old_table)
+    migrate(table, RESIZE_STEP);
+  if (!make_room(table)) {
+    return SLOT_NONE;
+  }
+  *inserted = false;
+  stats_begin_find();
+  // A key that has not moved yet is updated where it is.
+  if (table->old_table) {
+    *arrays = table->old_table;
+    size_t found =
+        engine_find(*arrays, key, table->key_handler.equal, hash, NULL);
+    if (found != SLOT_NONE && expired(*arrays, found)) {
+      reclaim_expired(table, *arrays, found);
+    } else if (found != SLOT_NONE) {
+      stats_end_find(table, HASH_TABLE_OP_INSERT);
+      mark_referenced(*arrays, found);
+      return found;
+    }
+  }
 
-  bool is_new_entry = (get_state(table, index) != STATE_OCCUPIED);
+  *arrays = table;
+  size_t index;
+  size_t found =
+      engine_find(table, key, table->key_handler.equal, hash, &index);
+  stats_end_find(table, HASH_TABLE_OP_INSERT);
+  if (found != SLOT_NONE && expired(table, found)) {
+    // The key is added again in place of the expired entry. Releasing its
+    // slot may move other entries, so the free slot is looked up again.
+    reclaim_expired(table, table, found);
+    index = engine_find_free(table, hash);
+  } else if (found != SLOT_NONE) {
+    mark_referenced(table, found);
+    return found;
+  }
 
-  if (is_new_entry) {
-    set_state(table, index, STATE_OCCUPIED);
-    entry->key = table->key_handler.copy(key);
-    entry->value = table->value_handler.copy(value);
-    table->count++;
+  if (table->bounded) {
+    uint64_t evictions = table->evictions;
+    evict_for(table, 1, charge);
+    // Evictions release slots, which may move entries.
+    if (table->evictions != evictions)
+      index = engine_find_free(table, hash);
+  }
+  index = claim_slot(table, index, hash);
+  if (index == SLOT_NONE)
+    return SLOT_NONE;
+  if (owned_key) {
+    store_owned(ht_entry(table, index), (void *)key, table->key_size);
   } else {
-    table->value_handler.destroy(entry->value);
-    entry->value = table->value_handler.copy(value);
+    store_key(table, index, key);
+  }
+  memset(value_slot(table, index), 0,
+         table->value_size ? table->value_size : sizeof(void *));
+  if (table->bounded) {
+    memset(ht_entry_meta(table, index), 0, sizeof(struct ht_entry_meta));
+    set_charge(table, index, charge);
   }
+  if (table->expiry)
+    *ht_entry_deadline(table, index) = 0;
+  if (table->hashes)
+    table->hashes[index] = hash;
+  table->count++;
+  *inserted = true;
+  return index;
+}
 
+// Inserts or replaces key's entry, which then expires at deadline in a
+// table with expiry.
+static bool insert_entry(HashTable *table, const void *key, uint64_t hash,
+                         const void *value, uint32_t deadline) {
+  HashTable *arrays;
+  bool inserted;
+  size_t charge = entry_charge(table, key, value);
+  size_t index =
+      find_or_add(table, key, hash, false, charge, &arrays, &inserted);
+  if (index == SLOT_NONE)
+    return false;
+  if (!inserted)
+    destroy_value(arrays, index);
+  store_value(arrays, index, value);
+  if (arrays->expiry)
+    *ht_entry_deadline(arrays, index) = deadline;
+  if (table->bounded && !inserted)
+    recharge(table, index, charge, key, hash);
   return true;
 }
 
-void *hash_table_lookup(const HashTable *table, const void *key) {
-  if (table->count == 0)
+bool ht_insert_hashed(HashTable *table, const void *key, uint64_t hash,
+                      const void *value) {
+  return insert_entry(table, key, hash, value, 0);
+}
+
+bool ht_insert_absent(HashTable *table, const void *key, uint64_t hash,
+                      const void *value) {
+  if (table->read_only || !make_room(table))
+    return false;
+  size_t charge = entry_charge(table, key, value);
+  if (table->bounded && !evict_for(table, 1, charge))
+    return false;
+  size_t index = claim_slot(table, engine_find_free(table, hash), hash);
+  if (index == SLOT_NONE)
+    return false;
+  store_key(table, index, key);
+  store_value(table, index, value);
+  if (table->bounded) {
+    memset(ht_entry_meta(table, index), 0, sizeof(struct ht_entry_meta));
+    set_charge(table, index, charge);
+  }
+  if (table->expiry)
+    *ht_entry_deadline(table, index) = 0;
+  if (table->hashes)
+    table->hashes[index] = hash;
+  table->count++;
+  return true;
+}
+
+bool hash_table_insert_owned(HashTable *table, void *key, void *value) {
+  HashTable *arrays;
+  bool inserted;
+  size_t charge = entry_charge(table, key, value);
+  uint64_t hash = ht_hash_key(table, key);
+  size_t index =
+      find_or_add(table, key, hash, true, charge, &arrays, &inserted);
+  if (index == SLOT_NONE)
+    return false;
+  if (!inserted)
+    destroy_value(arrays, index);
+  store_owned(value_slot(arrays, index), value, table->value_size);
+  if (arrays->expiry)
+    *ht_entry_deadline(arrays, index) = 0;
+  if (!inserted) {
+    if (table->bounded)
+      recharge(table, index, charge, key, hash);
+    // The table keeps the key it already has, so the one passed in, which
+    // it now owns, goes.
+    if (!table->key_size)
+      ht_destroy_data(table, &table->key_handler, key);
+  }
+  return true;
+}
+
+bool hash_table_insert(HashTable *table, void *key, void *value) {
+  return ht_insert_hashed(table, key, ht_hash_key(table, key), value);
+}
+
+bool hash_table_insert_ttl(HashTable *table, void *key, void *value,
+                           uint32_t ttl) {
+  if (!table->expiry)
+    return false;
+  uint32_t deadline = 0;
+  if (ttl) {
+    deadline = expiry_now(table) + ttl;
+    deadline += deadline == 0; // 0 would mean no deadline
+  }
+  return insert_entry(table, key, ht_hash_key(table, key), value, deadline);
+}
+
+void *hash_table_get_or_insert(HashTable *table, const void *key,
+                               bool *inserted) {
+  HashTable *arrays;
+  bool added;
+  size_t index = find_or_add(table, key, ht_hash_key(table, key), false,
+                             entry_charge(table, key, NULL), &arrays, &added);
+  if (index == SLOT_NONE)
     return NULL;
-  size_t index = find_entry_index(table, key, false);
-  if (get_state(table, index) == STATE_OCCUPIED) {
-    return table->entries[index].value;
+  if (inserted)
+    *inserted = added;
+  return value_slot(arrays, index);
+}
+
+bool hash_table_upsert(HashTable *table, const void *key, upsert_function fn,
+                       void *ctx) {
+  HashTable *arrays;
+  bool inserted;
+  size_t index = find_or_add(table, key, ht_hash_key(table, key), false,
+                             entry_charge(table, key, NULL), &arrays,
+                             &inserted);
+  if (index == SLOT_NONE)
+    return false;
+  fn(value_slot(arrays, index), inserted, ctx);
+  return true;
+}
+
+// Lookups take a const table and may run concurrently under a reader lock,
+// so unlike inserts and deletes they never advance an incremental resize.
+static void *find_value(const HashTable *table, const void *key,
+                        key_equal_function equal, uint64_t hash) {
+  HashTable *arrays;
+  size_t index = find_entry(table, key, equal, hash, HASH_TABLE_OP_LOOKUP,
+                            &arrays);
+  if (index != SLOT_NONE && !expired(arrays, index)) {
+    mark_referenced(arrays, index);
+    return ht_entry_value(arrays, index);
   }
   return NULL;
 }
 
+void *ht_lookup_hashed(const HashTable *table, const void *key,
+                       uint64_t hash) {
+  return find_value(table, key, table->key_handler.equal, hash);
+}
+
+void *hash_table_lookup(const HashTable *table, const void *key) {
+  if (hash_table_count(table) == 0) // skip hashing
+    return NULL;
+  return ht_lookup_hashed(table, key, ht_hash_key(table, key));
+}
+
 bool hash_table_delete(HashTable *table, const void *key) {
-  if (table->count == 0)
+  if (hash_table_count(table) == 0) // skip hashing
     return false;
-  size_t index = find_entry_index(table, key, false);
+  return ht_delete_hashed(table, key, ht_hash_key(table, key));
+}
+
+// Marks a slot whose key and value have been dealt with as free.
+static void free_slot(HashTable *arrays, size_t index) {
+  if (arrays->bounded)
+    arrays->bytes -= ht_entry_meta(arrays, index)->charge;
+  ht_clear_entry(arrays, index);
+  // May move later entries into the freed slot.
+  engine_release(arrays, index);
+  arrays->count--;
+}
+
+// Removes key, compared by equal. The key and value are destroyed, or
+// copied out to key_out and value_out when those are non-NULL.
+static bool remove_entry(HashTable *table, const void *key,
+                         key_equal_function equal, uint64_t hash,
+                         void *key_out, void *value_out) {
+  if (table->read_only)
+    return false;
+  if (table->old_table)
+    migrate(table, RESIZE_STEP);
+  HashTable *arrays;
+  size_t index =
+      find_entry(table, key, equal, hash, HASH_TABLE_OP_DELETE, &arrays);
 
-  if (get_state(table, index) != STATE_OCCUPIED) {
+  if (index == SLOT_NONE) {
+    return false;
+  }
+  if (expired(arrays, index)) {
+    reclaim_expired(table, arrays, index);
     return false;
   }
 
-  struct InternalEntry *entry = &table->entries[index];
-  table->key_handler.destroy(entry->key);
-  table->value_handler.destroy(entry->value);
-  set_state(table, index, STATE_DELETED);
-  entry->key = NULL;
-  entry->value = NULL;
-  table->count--;
+  if (key_out) {
+    load_slot(key_out, ht_entry(arrays, index), arrays->key_size);
+  } else if (!arrays->key_size) {
+    ht_destroy_data(arrays, &arrays->key_handler, ht_entry_key(arrays, index));
+  }
+  if (value_out) {
+    load_slot(value_out, value_slot(arrays, index), arrays->value_size);
+  } else {
+    destroy_value(arrays, index);
+  }
+  free_slot(arrays, index);
+  return true;
+}
+
+void ht_erase(HashTable *table, size_t index) {
+  if (!table->key_size)
+    ht_destroy_data(table, &table->key_handler, ht_entry_key(table, index));
+  destroy_value(table, index);
+  free_slot(table, index);
+}
+
+bool ht_delete_hashed(HashTable *table, const void *key, uint64_t hash) {
+  return remove_entry(table, key, table->key_handler.equal, hash, NULL, NULL);
+}
+
+// The hash the engines use, from one the key handler returned.
+static uint64_t engine_hash(const HashTable *table, uint64_t hash) {
+  return table->key_handler.hash_with_seed ? hash : ht_mix_hash(hash);
+}
+
+void *hash_table_lookup_hashed(const HashTable *table, uint64_t hash,
+                               const void *probe, key_equal_function equal) {
+  if (hash_table_count(table) == 0)
+    return NULL;
+  return find_value(table, probe, equal, engine_hash(table, hash));
+}
+
+bool hash_table_insert_hashed(HashTable *table, uint64_t hash, void *key,
+                              void *value) {
+  return ht_insert_hashed(table, key, engine_hash(table, hash), value);
+}
+
+bool hash_table_delete_hashed(HashTable *table, uint64_t hash,
+                              const void *probe, key_equal_function equal) {
+  if (hash_table_count(table) == 0)
+    return false;
+  return remove_entry(table, probe, equal, engine_hash(table, hash), NULL,
+                      NULL);
+}
+
+bool hash_table_take(HashTable *table, const void *key, void *key_out,
+                     void *value_out) {
+  if (hash_table_count(table) == 0) // skip hashing
+    return false;
+  return remove_entry(table, key, table->key_handler.equal,
+                      ht_hash_key(table, key), key_out, value_out);
+}
+
+size_t hash_table_count(const HashTable *table) {
+  return table->count + (table->old_table ? table->old_table->count : 0);
+}
+
+// Issues prefetches for the control byte, entry and cached hash where the
+// probe for hash starts, so that the misses of a whole batch overlap.
+static void prefetch_home(const HashTable *table, uint64_t hash) {
+  size_t index = engine_home(table, hash);
+  size_t control_offset =
+      table->engine == HASH_TABLE_ENGINE_LINEAR ? index / 4 : index;
+  __builtin_prefetch(table->control_bytes + control_offset);
+  __builtin_prefetch(ht_entry(table, index));
+  if (table->hashes)
+    __builtin_prefetch(table->hashes + index);
+}
+
+size_t hash_table_lookup_batch(const HashTable *table, const void *const *keys,
+                               size_t n, void **out_values) {
+  uint64_t hashes[BATCH_CHUNK];
+  size_t found = 0;
+
+  for (size_t start = 0; start < n; start += BATCH_CHUNK) {
+    size_t chunk = n - start < BATCH_CHUNK ? n - start : BATCH_CHUNK;
+    if (hash_table_count(table) == 0) {
+      for (size_t i = 0; i < chunk; i++)
+        out_values[start + i] = NULL;
+      continue;
+    }
+    for (size_t i = 0; i < chunk; i++) {
+      hashes[i] = ht_hash_key(table, keys[start + i]);
+      prefetch_home(table, hashes[i]);
+    }
+    for (size_t i = 0; i < chunk; i++) {
+      out_values[start + i] = find_value(table, keys[start + i],
+                                         table->key_handler.equal, hashes[i]);
+      found += out_values[start + i] != NULL;
+    }
+  }
+  return found;
+}
+
+size_t hash_table_insert_batch(HashTable *table, const void *const *keys,
+                               const void *const *values, size_t n) {
+  uint64_t hashes[BATCH_CHUNK];
+
+  for (size_t start = 0; start < n; start += BATCH_CHUNK) {
+    size_t chunk = n - start < BATCH_CHUNK ? n - start : BATCH_CHUNK;
+    // Growing first keeps the prefetched slots in the arrays being probed.
+    if (!hash_table_reserve(table, hash_table_count(table) + chunk))
+      return start;
+    for (size_t i = 0; i < chunk; i++) {
+      hashes[i] = ht_hash_key(table, keys[start + i]);
+      prefetch_home(table, hashes[i]);
+    }
+    for (size_t i = 0; i < chunk; i++) {
+      if (!ht_insert_hashed(table, keys[start + i], hashes[i],
+                            values[start + i]))
+        return start + i;
+    }
+  }
+  return n;
+}
+
+HashTable *hash_table_build_parallel(type_handler key_handler,
+                                     type_handler value_handler,
+                                     const hash_table_options *options,
+                                     const void *const *keys,
+                                     const void *const *values, size_t n,
+                                     size_t threads) {
+  hash_table_options opts = options ? *options : (hash_table_options){0};
+  if (opts.initial_capacity < n)
+    opts.initial_capacity = n;
+  HashTable *table =
+      hash_table_create_with_options(key_handler, value_handler, NULL, &opts);
+  if (!table)
+    return NULL;
+  // Filling regions in parallel would leave out a bounded table's
+  // evictions and charges.
+  bool built = threads > 1 && n >= PARALLEL_MIN_ENTRIES && !table->bounded
+                   ? fill_parallel(table, NULL, keys, values, n, threads)
+                   : hash_table_insert_batch(table, keys, values, n) == n;
+  if (!built) {
+    hash_table_destroy(table);
+    return NULL;
+  }
+  return table;
+}
+
+size_t hash_table_capacity(const HashTable *table) { return table->capacity; }
+
+void hash_table_get_stats(const HashTable *table, hash_table_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->count = hash_table_count(table);
+  stats->capacity = table->capacity;
+  stats->tombstones = table->tombstones;
+  if (table->old_table)
+    stats->tombstones += table->old_table->tombstones;
+  stats->load_factor = (double)stats->count / table->capacity;
+  stats->resizing = table->old_table != NULL;
+  stats->bytes = table->bytes;
+  stats->evictions = table->evictions;
+  stats->expirations = table->expirations;
+  stats_load(table, stats);
+}
+
+void hash_table_reset_stats(HashTable *table) { stats_reset(table); }
 
+bool hash_table_reserve(HashTable *table, size_t entries) {
+  if (table->read_only)
+    return false;
+  // A bounded table already has room for everything it may hold.
+  if (table->max_entries && entries > bounded_load(table->max_entries))
+    entries = bounded_load(table->max_entries);
+  size_t capacity = capacity_for(table, entries);
+  if (capacity == 0)
+    return false;
+  if (capacity > table->capacity)
+    return resize(table, capacity);
+  // Tombstones count towards the load too, and would otherwise make one of
+  // the inserts still grow or rehash the table.
+  if (table->tombstones > 0 &&
+      entries + table->tombstones > table->capacity * table->max_load_factor) {
+    finish_resize(table);
+    rehash_in_place(table);
+  }
+  return true;
+}
+
+bool hash_table_shrink_to_fit(HashTable *table) {
+  if (table->read_only)
+    return false;
+  finish_resize(table);
+  // A bounded table keeps its slots for the entries it will refill them
+  // with.
+  size_t capacity = capacity_for(table, table->count);
+  if (!table->max_entries && capacity < table->capacity)
+    return resize(table, capacity);
+  if (table->tombstones > 0)
+    rehash_in_place(table);
   return true;
 }
 
-size_t hash_table_count(const HashTable *table) { return table->count; }
+// hash_table_freeze() packs entries at this load. The entries of a home
+// then start about ten slots after it on average, mostly within the first
+// 16 control bytes a lookup compares. Should an entry land beyond
+// HT_ROBIN_MAX_DISTANCE, the homes are spread over an eighth more slots and
+// placed again.
+#define FREEZE_LOAD_FACTOR 0.95
+#define FREEZE_ATTEMPTS 8
+
+// Sorts the n entries by their home among buckets with a counting sort,
+// into order, and returns the slots the packed layout needs, its empty
+// tail included, or 0 if an entry would be too far from home.
+static size_t freeze_layout(const HashTable *frozen, const uint64_t *hashes,
+                            size_t n, size_t *counts, size_t *order) {
+  size_t buckets = frozen->frozen_buckets;
+  memset(counts, 0, sizeof(size_t) * (buckets + 1));
+  for (size_t i = 0; i < n; i++)
+    counts[ht_frozen_home(frozen, hashes[i]) + 1]++;
+  for (size_t b = 0; b < buckets; b++)
+    counts[b + 1] += counts[b];
+  for (size_t i = 0; i < n; i++)
+    order[counts[ht_frozen_home(frozen, hashes[i])]++] = i;
+
+  // Each entry takes its home or the slot after the previous entry,
+  // whichever is later: the order a Robin Hood table keeps runs in.
+  size_t end = 0;
+  for (size_t k = 0; k < n; k++) {
+    size_t home = ht_frozen_home(frozen, hashes[order[k]]);
+    if (end < home)
+      end = home;
+    if (end - home > HT_ROBIN_MAX_DISTANCE)
+      return 0;
+    end++;
+  }
+  return (end > buckets ? end : buckets) + HT_FROZEN_TAIL;
+}
+
+bool hash_table_freeze(HashTable *table) {
+  if (table->frozen_buckets)
+    return true;
+  finish_resize(table);
+  uint64_t start = stats_clock();
+  size_t n = table->count;
+  // One more than needed, so that an empty table does not ask for 0 bytes.
+  uint64_t *hashes = malloc(sizeof(uint64_t) * (n + 1));
+  size_t *sources = malloc(sizeof(size_t) * (n + 1));
+  size_t *order = malloc(sizeof(size_t) * (n + 1));
+  size_t *counts = NULL;
+  bool ok = hashes && sources && order;
+  for (size_t i = 0, j = 0; ok && i < table->capacity; i++) {
+    if (!engine_is_occupied(table, i))
+      continue;
+    hashes[j] = table->hashes ? table->hashes[i]
+                              : ht_hash_key(table, ht_entry_key(table, i));
+    sources[j++] = i;
+  }
+
+  HashTable frozen = *table;
+  frozen.engine = HASH_TABLE_ENGINE_ROBIN_HOOD;
+  frozen.frozen_buckets = (size_t)(n / FREEZE_LOAD_FACTOR) + 1;
+  size_t slots = 0;
+  for (int attempt = 0; ok && !slots && attempt < FREEZE_ATTEMPTS;
+       attempt++) {
+    if (attempt > 0)
+      frozen.frozen_buckets += frozen.frozen_buckets / 8 + 1;
+    free(counts);
+    counts = malloc(sizeof(size_t) * (frozen.frozen_buckets + 1));
+    ok = counts != NULL;
+    if (ok)
+      slots = freeze_layout(&frozen, hashes, n, counts, order);
+  }
+
+  uint8_t *control_bytes;
+  unsigned char *entries;
+  uint64_t *frozen_hashes;
+  ok = ok && slots &&
+       allocate_slots(&frozen, slots, true, &control_bytes, &entries,
+                      &frozen_hashes);
+  if (ok) {
+    frozen.capacity = slots;
+    frozen.control_bytes = control_bytes;
+    ht_set_entries(&frozen, entries, slots);
+    frozen.hashes = frozen_hashes;
+    size_t index = 0;
+    for (size_t k = 0; k < n; k++) {
+      size_t j = order[k];
+      size_t home = ht_frozen_home(&frozen, hashes[j]);
+      if (index < home)
+        index = home;
+      control_bytes[index] = (uint8_t)(index - home + 1);
+      ht_copy_entry(&frozen, index, table, sources[j]);
+      if (frozen_hashes)
+        frozen_hashes[index] = hashes[j];
+      index++;
+    }
+    free_slots(table, table->capacity, table->control_bytes, table->entries,
+               table->hashes);
+    table->engine = HASH_TABLE_ENGINE_ROBIN_HOOD;
+    table->capacity = slots;
+    table->control_bytes = control_bytes;
+    ht_set_entries(table, entries, slots);
+    table->hashes = frozen_hashes;
+    table->tombstones = 0;
+    table->frozen_buckets = frozen.frozen_buckets;
+    table->read_only = true;
+    stats_record_resize(table, start);
+  }
+  free(hashes);
+  free(sources);
+  free(order);
+  free(counts);
+  return ok;
+}
+
+bool hash_table_resize_step(HashTable *table, size_t max_slots) {
+  if (table->old_table)
+    migrate(table, max_slots);
+  return table->old_table != NULL;
+}
+
+size_t hash_table_expire_step(HashTable *table, size_t max_slots) {
+  if (!table->expiry || table->read_only)
+    return 0;
+  uint32_t now = expiry_now(table);
+  size_t reclaimed = 0;
+  for (size_t i = 0; i < max_slots && i < table->capacity; i++) {
+    size_t index = table->expire_cursor++ & (table->capacity - 1);
+    // Releasing a ROBIN_HOOD slot shifts the next entry back into it, so
+    // the slot is checked again.
+    while (engine_is_occupied(table, index) &&
+           deadline_passed(*ht_entry_deadline(table, index), now)) {
+      ht_erase(table, index);
+      reclaimed++;
+    }
+  }
+  table->expirations += reclaimed;
+  return reclaimed;
+}
+
+// Next occupied slot at or after index, or arrays->capacity. The linear
+// engine skips four empty slots per control byte.
+static size_t next_occupied(const HashTable *arrays, size_t index) {
+  while (index < arrays->capacity) {
+    if (arrays->engine == HASH_TABLE_ENGINE_LINEAR && index % 4 == 0 &&
+        (arrays->control_bytes[index / 4] & 0x55) == 0) {
+      index += 4;
+      continue;
+    }
+    if (engine_is_occupied(arrays, index))
+      return index;
+    index++;
+  }
+  return arrays->capacity;
+}
+
+hash_table_iterator hash_table_iter(const HashTable *table) {
+  return (hash_table_iterator){table, table, 0};
+}
+
+bool hash_table_iter_next(hash_table_iterator *it, void **key, void **value) {
+  while (it->arrays) {
+    it->index = next_occupied(it->arrays, it->index);
+    if (it->index < it->arrays->capacity) {
+      if (key)
+        *key = ht_entry_key(it->arrays, it->index);
+      if (value)
+        *value = ht_entry_value(it->arrays, it->index);
+      it->index++;
+      return true;
+    }
+    // During an incremental resize the old arrays come second.
+    it->arrays = it->arrays == it->table ? it->table->old_table : NULL;
+    it->index = 0;
+  }
+  return false;
+}
+
+static void linear_scan_bucket(const HashTable *table, size_t bucket,
+                               scan_function fn, void *ctx) {
+  size_t mask = table->capacity - 1;
+  size_t index = bucket;
+  for (size_t probes = 0; probes < table->capacity; probes++) {
+    uint8_t state = ht_linear_state(table, index);
+    if (state == HT_STATE_EMPTY)
+      break;
+    if (state == HT_STATE_OCCUPIED) {
+      uint64_t hash = table->hashes
+                          ? table->hashes[index]
+                          : ht_hash_key(table, ht_entry_key(table, index));
+      if ((hash & mask) == bucket)
+        fn(ht_entry_key(table, index), ht_entry_value(table, index), ctx);
+    }
+    index = (index + 1) & mask;
+  }
+}
+
+static size_t engine_scan_buckets(const HashTable *table) {
+  if (table->engine == HASH_TABLE_ENGINE_SWISS)
+    return ht_swiss_scan_buckets(table);
+  if (table->frozen_buckets)
+    return table->frozen_buckets;
+  return table->capacity;
+}
+
+static void engine_scan_bucket(const HashTable *table, size_t bucket,
+                               scan_function fn, void *ctx) {
+  switch (table->engine) {
+  case HASH_TABLE_ENGINE_SWISS:
+    ht_swiss_scan_bucket(table, bucket, fn, ctx);
+    break;
+  case HASH_TABLE_ENGINE_ROBIN_HOOD:
+    ht_robin_scan_bucket(table, bucket, fn, ctx);
+    break;
+  default:
+    linear_scan_bucket(table, bucket, fn, ctx);
+    break;
+  }
+}
+
+static size_t reverse_bits(size_t v) {
+  size_t r = 0;
+  for (size_t i = 0; i < sizeof(size_t) * 8; i++) {
+    r = (r << 1) | (v & 1);
+    v >>= 1;
+  }
+  return r;
+}
+
+// Adds one to the cursor's bits under mask, counting from the most
+// significant of them, so that every bucket of a smaller table is visited
+// before the ones that split from it in a larger one.
+static size_t next_cursor(size_t cursor, size_t mask) {
+  cursor |= ~mask;
+  return reverse_bits(reverse_bits(cursor) + 1);
+}
+
+size_t hash_table_scan(const HashTable *table, size_t cursor, scan_function fn,
+                       void *ctx) {
+  // A frozen table never resizes, and its home count need not be a power
+  // of two, so the cursor just counts through the homes.
+  if (table->frozen_buckets) {
+    if (cursor < table->frozen_buckets)
+      engine_scan_bucket(table, cursor, fn, ctx);
+    return cursor + 1 < table->frozen_buckets ? cursor + 1 : 0;
+  }
+  if (!table->old_table) {
+    size_t mask = engine_scan_buckets(table) - 1;
+    engine_scan_bucket(table, cursor & mask, fn, ctx);
+    return next_cursor(cursor, mask);
+  }
+
+  // During an incremental resize, scan the bucket of the smaller arrays and
+  // then every bucket of the larger ones that it splits into.
+  const HashTable *small = table->old_table;
+  const HashTable *large = table;
+  if (engine_scan_buckets(small) > engine_scan_buckets(large)) {
+    small = table;
+    large = table->old_table;
+  }
+  size_t small_mask = engine_scan_buckets(small) - 1;
+  size_t large_mask = engine_scan_buckets(large) - 1;
+  engine_scan_bucket(small, cursor & small_mask, fn, ctx);
+  do {
+    engine_scan_bucket(large, cursor & large_mask, fn, ctx);
+    cursor = next_cursor(cursor, large_mask);
+  } while (cursor & (small_mask ^ large_mask));
+  return cursor;
+}
@@ -6,16 +6,74 @@
 #include <stdint.h>
 
 typedef uint64_t (*hash_function)(const void *key);
+// Hash that also takes the key's inline size (0 for pointer keys) and the
+// table's seed. Its result is used as it is, so all 64 bits must be well
+// mixed; the built-in hashes below are of this kind.
+typedef uint64_t (*seeded_hash_function)(const void *key, size_t size,
+                                         uint64_t seed);
 typedef bool (*key_equal_function)(const void *key1, const void *key2);
 typedef void *(*copy_function)(const void *original);
 typedef void (*destroy_function)(void *data);
 typedef void *(*alloc_function)(size_t size);
 typedef void (*free_function)(void *ptr);
+
+// Allocator with per-instance state. alloc returns size bytes aligned to
+// alignment (a power of two), free receives the size that was requested,
+// and release, if set, frees everything allocated through ctx in one go.
+typedef void *(*context_alloc_function)(void *ctx, size_t size,
+                                        size_t alignment);
+typedef void (*context_free_function)(void *ctx, void *ptr, size_t size);
+typedef void (*context_release_function)(void *ctx);
+typedef struct {
+  context_alloc_function alloc;
+  context_free_function free;
+  context_release_function release; // Optional
+  void *ctx;
+} context_allocator;
+
+// Handler variants that allocate through the table's allocator.
+typedef void *(*allocator_copy_function)(const void *original,
+                                         const context_allocator *allocator);
+typedef void (*allocator_destroy_function)(void *data,
+                                           const context_allocator *allocator);
+
+// Byte sinks and sources for hash_table_serialize_stream() and
+// hash_table_deserialize_stream(), such as a socket or a compressor.
+// write stores size bytes and read fills exactly size bytes; both return
+// false on error.
+typedef struct {
+  bool (*write)(void *ctx, const void *data, size_t size);
+  void *ctx;
+} hash_table_writer;
+typedef struct {
+  bool (*read)(void *ctx, void *data, size_t size);
+  void *ctx;
+} hash_table_reader;
+
+// Serialization hooks for pointer keys and values. encode writes data
+// through writer; decode reads one item back and returns a new object that
+// the destroy handlers can free, or NULL on error.
+typedef bool (*encode_function)(const void *data,
+                                const hash_table_writer *writer);
+typedef void *(*decode_function)(const hash_table_reader *reader);
+
 typedef struct {
   copy_function copy;
   destroy_function destroy;
   key_equal_function equal; // Only used for keys
   hash_function hash;       // Only used for keys
+  // Optional, only used for keys; used instead of hash when set, with the
+  // seed from hash_table_options.
+  seeded_hash_function hash_with_seed;
+  // Optional; used instead of copy/destroy when set. The table passes its
+  // own allocator, so keys and values can live in the same arena as the
+  // table. If the allocator has a release function, hash_table_destroy()
+  // skips calling destroy_with_allocator and releases everything at once.
+  allocator_copy_function copy_with_allocator;
+  allocator_destroy_function destroy_with_allocator;
+  // Optional; needed to serialize tables that store this side as pointers.
+  encode_function encode;
+  decode_function decode;
 } type_handler;
 
 typedef struct {
@@ -23,16 +81,456 @@ typedef struct {
   free_function free;
 } allocator;
 
+typedef enum {
+  // Linear probing over 2-bit slot states; the smallest control overhead.
+  HASH_TABLE_ENGINE_LINEAR = 0,
+  // One control byte per slot holding a 7-bit hash fingerprint, probed 16
+  // slots at a time with SSE2/NEON. Faster lookups at high load factors.
+  HASH_TABLE_ENGINE_SWISS,
+  // Robin Hood linear probing with a one-byte probe distance per slot.
+  // Keeps probe lengths short and even at high load factors, stops
+  // unsuccessful lookups early, and deletes without tombstones. Inserts
+  // fail once more than about 250 keys collide on the same hash.
+  HASH_TABLE_ENGINE_ROBIN_HOOD,
+} hash_table_engine;
+
+// Called with the key and value of an entry a bounded table evicts, as
+// hash_table_lookup() would return them, just before they are destroyed.
+// Must not modify the table.
+typedef void (*evict_function)(const void *key, void *value, void *ctx);
+
+// Returns the current time in seconds, for tables created with expiry.
+// Only differences between its results matter, so any epoch will do.
+typedef uint64_t (*expiry_clock_function)(void *ctx);
+
+typedef struct {
+  hash_table_engine engine;
+  // Grow once count / capacity would exceed this. 0 selects the engine's
+  // default (0.75 for LINEAR, 0.875 for SWISS, 0.9 for ROBIN_HOOD);
+  // otherwise it must lie in [0.25, 1).
+  double max_load_factor;
+  // Keep each key's full 64-bit hash next to its slot. Probes compare the
+  // stored hash before calling equal, and resizing reuses it instead of
+  // calling hash again, at the cost of 8 bytes per slot.
+  bool cache_hashes;
+  // Store keys and values of this many bytes inline in the slot array
+  // instead of as pointers to handler-made copies. Inline data is copied
+  // with memcpy and never passed to the copy or destroy handlers, so it
+  // must be plain data that needs no cleanup. hash_table_lookup() returns a
+  // pointer into the table that stays valid until the next insert or
+  // delete. 0 keeps the pointer behaviour. Inline data is stored at 8-byte
+  // alignment.
+  size_t key_size;
+  size_t value_size;
+  // Allocator for the table and for handlers that use copy_with_allocator.
+  // Takes precedence over the custom_allocator argument. Copied at
+  // creation; ctx must stay valid for the lifetime of the table.
+  const context_allocator *allocator;
+  // Number of entries to make room for up front, so that loading a known
+  // amount of data does not go through repeated resizes. 0 starts small.
+  size_t initial_capacity;
+  // Grow without a pause: when the table is full, allocate the larger
+  // arrays and move entries over a few slots at a time on each later
+  // insert and delete, instead of all at once. Lookups check both arrays
+  // until every entry has moved. Ignored by ROBIN_HOOD, whose inserts into
+  // the new arrays could fail part way through.
+  bool incremental_resize;
+  // Passed to the key handler's hash_with_seed. With a secret random seed,
+  // such as one from hash_table_random_seed(), whoever chooses the keys
+  // cannot work out in advance which of them will collide.
+  uint64_t seed;
+  // Keeps the values in an array of their own, after the keys in the same
+  // allocation, instead of each value right after its key. Probes then
+  // only bring keys into the cache, which pays off when most lookups miss
+  // or values are large; a hit takes one more cache miss for its value.
+  bool separate_values;
+  // Threads a resize of a table with at least 65536 entries spreads the
+  // rehashing over, each filling its own ranges of the new arrays; 0 or 1
+  // resizes on the calling thread. The threads call the key handler's hash
+  // unless cache_hashes is set, so it must be safe to call concurrently.
+  // Does not apply to the steps of an incremental_resize.
+  size_t resize_threads;
+  // Bounds the table as a cache: inserting a new key first evicts entries
+  // until the table holds fewer than max_entries and the new entry's
+  // charge fits under max_bytes, instead of growing past them. 0 leaves
+  // either unbounded. Victims are chosen by CLOCK: every lookup or update
+  // of an entry sets a flag kept next to its key, and a hand sweeping the
+  // slots evicts the first entry whose flag is clear, clearing the flags it
+  // passes. A new entry starts with a clear flag, so entries used only
+  // once are evicted before ones used again. A table with max_entries is
+  // created with room for all of them and never resizes to hold more.
+  // Bounded tables ignore incremental_resize, cost 8 more bytes per slot
+  // and cannot be written by hash_table_save().
+  size_t max_entries;
+  size_t max_bytes;
+  // The charge of an entry towards max_bytes, given the key and value
+  // passed to the insert that adds the entry or replaces its value (NULL
+  // for hash_table_get_or_insert() and hash_table_upsert()), and counted
+  // until the entry leaves. NULL charges every entry the bytes of its
+  // slot. An entry charged more than max_bytes is refused.
+  size_t (*entry_bytes)(const void *key, const void *value);
+  // Called on every evicted entry, if set.
+  evict_function on_evict;
+  void *evict_ctx;
+  // Lets entries expire. hash_table_insert_ttl() gives an entry a lifetime
+  // in seconds, kept as a 32-bit deadline next to its key at a cost of 8
+  // more bytes per slot. Once the deadline has passed, lookups miss the
+  // entry, the next insert or delete of its key reclaims it, and
+  // hash_table_expire_step() reclaims it when its sweep comes by. Until it
+  // is reclaimed it is still counted, and still visited by iterators and
+  // hash_table_scan(). Tables with expiry cannot be written by
+  // hash_table_save().
+  bool expiry;
+  // The clock deadlines are kept in. NULL reads the system's calendar time.
+  expiry_clock_function expiry_clock;
+  void *expiry_ctx;
+} hash_table_options;
+
 typedef struct HashTable HashTable;
 
+// Built-in hashes, ready to use as type_handler.hash_with_seed. All but
+// crc32c are wyhash-style multiply-mix hashes.
+//   hash_table_hash_u64:    8-byte integer keys, in two multiplies.
+//   hash_table_hash_bytes:  inline keys of any size, over all of their
+//                           bytes, so any padding in them must be zeroed.
+//   hash_table_hash_string: NUL-terminated strings, for pointer keys.
+//   hash_table_hash_crc32c: like hash_table_hash_bytes, using the CPU's
+//                           CRC32C instruction (SSE4.2 or ARMv8) when
+//                           there is one. CRC is linear, so keys that
+//                           collide do so under every seed: use it only
+//                           for trusted keys.
+// They can also be called directly, with any size, to build a hash for a
+// composite key by chaining one result into the next call's seed.
+uint64_t hash_table_hash_u64(const void *key, size_t size, uint64_t seed);
+uint64_t hash_table_hash_bytes(const void *key, size_t size, uint64_t seed);
+uint64_t hash_table_hash_string(const void *key, size_t size, uint64_t seed);
+uint64_t hash_table_hash_crc32c(const void *key, size_t size, uint64_t seed);
+// 64 bits from the operating system's random source, for seeding tables
+// whose keys come from untrusted input.
+uint64_t hash_table_random_seed(void);
+
 HashTable *hash_table_create(type_handler key_handler,
                              type_handler value_handler,
                              allocator *custom_allocator);
 
+// Like hash_table_create(), with optional behaviour selected by options.
+// Passing NULL options is the same as calling hash_table_create().
+HashTable *hash_table_create_with_options(type_handler key_handler,
+                                          type_handler value_handler,
+                                          allocator *custom_allocator,
+                                          const hash_table_options *options);
+
 void hash_table_destroy(HashTable *table);
 bool hash_table_insert(HashTable *table, void *key, void *value);
 void *hash_table_lookup(const HashTable *table, const void *key);
 bool hash_table_delete(HashTable *table, const void *key);
+
+// Like hash_table_insert(), but the table takes ownership of key and value
+// instead of copying them through the handlers; they must be something the
+// destroy handlers can free. If key is already present, the table keeps
+// its existing key and destroys the one passed in. Inline keys and values
+// are copied as usual. Returns false, leaving ownership with the caller,
+// if there was no memory for a new entry.
+bool hash_table_insert_owned(HashTable *table, void *key, void *value);
+// Removes key like hash_table_delete(), but hands the stored key and value
+// back to the caller instead of destroying them. key_out and value_out
+// receive the contents of the slot: the inline bytes, or the stored
+// pointer (so pass a void ** in pointer mode). Either may be NULL, in
+// which case that side is destroyed as usual. Returns false if the key was
+// not present.
+bool hash_table_take(HashTable *table, const void *key, void *key_out,
+                     void *value_out);
+
+// Like hash_table_insert(), but the entry expires ttl seconds from now, to
+// within a second, in a table created with expiry; ttl must be below 2^31.
+// hash_table_insert() and hash_table_insert_owned() store entries that
+// never expire, as does a ttl of 0, while updates through
+// hash_table_get_or_insert() and hash_table_upsert() keep an entry's
+// deadline. Returns false if the table was created without expiry.
+bool hash_table_insert_ttl(HashTable *table, void *key, void *value,
+                           uint32_t ttl);
+// Checks the next max_slots slots of a table created with expiry, after
+// those of the previous call, and reclaims the expired entries among them.
+// Calling it regularly, for example after each batch of requests, spreads
+// the cost of expiry out instead of leaving it to a full sweep. Entries
+// still waiting to move out of the old arrays of an incremental resize are
+// checked once they have moved. Returns the number of entries reclaimed.
+size_t hash_table_expire_step(HashTable *table, size_t max_slots);
+
+// Variants for callers that already have the key's hash, as the key handler
+// would return it: its hash_with_seed called with the table's key size and
+// seed, or its hash. Lookups and deletes find the key by probe, which can
+// be any representation of it, such as a slice of a network buffer:
+// equal(stored_key, probe) is called instead of the key handler's equal,
+// and must agree with it. An insert needs a real key to store, so only the
+// hashing is skipped. A wrong hash finds nothing, or inserts a duplicate.
+void *hash_table_lookup_hashed(const HashTable *table, uint64_t hash,
+                               const void *probe, key_equal_function equal);
+bool hash_table_insert_hashed(HashTable *table, uint64_t hash, void *key,
+                              void *value);
+bool hash_table_delete_hashed(HashTable *table, uint64_t hash,
+                              const void *probe, key_equal_function equal);
+
+// Finds key, adding it if missing, with a single probe. Returns its value
+// slot, or NULL if the key had to be added and there was no memory for it.
+// *inserted, if inserted is non-NULL, tells whether the key was added. The
+// key is copied as on insert; the value is not touched.
+//
+// The value slot is the value itself for inline values (value_size > 0),
+// and otherwise the stored value pointer, so the return value is really a
+// void **. A new key starts with an all-zero slot: zeroed bytes, or a NULL
+// pointer. A pointer stored into the slot belongs to the table from then
+// on and is eventually passed to the value destroy handler. The slot stays
+// valid until the next insert or delete.
+void *hash_table_get_or_insert(HashTable *table, const void *key,
+                               bool *inserted);
+
+// Called by hash_table_upsert() with the key's value slot, as returned by
+// hash_table_get_or_insert(), to update it in place.
+typedef void (*upsert_function)(void *value_slot, bool inserted, void *ctx);
+
+// Calls fn on key's value slot after a single probe, adding the key with
+// a zeroed slot first if it is missing. Unlike hash_table_insert() this
+// does not copy or destroy any value. Returns false, without calling fn,
+// if the key could not be added.
+bool hash_table_upsert(HashTable *table, const void *key, upsert_function fn,
+                       void *ctx);
+
+// Looks up n keys at once. All keys of a chunk are hashed and their home
+// slots prefetched before any probe runs, so the cache misses of a batch
+// overlap instead of being paid one after another. out_values[i] receives
+// what hash_table_lookup(table, keys[i]) would return. Returns the number
+// of keys found.
+size_t hash_table_lookup_batch(const HashTable *table, const void *const *keys,
+                               size_t n, void **out_values);
+// Inserts n key/value pairs with the same prefetching as
+// hash_table_lookup_batch(). Returns the number of pairs stored, which is
+// less than n only if an insert failed; pairs after it are not inserted.
+size_t hash_table_insert_batch(HashTable *table, const void *const *keys,
+                               const void *const *values, size_t n);
+// Creates a table holding the n key/value pairs, as if made by
+// hash_table_create_with_options() and filled by hash_table_insert() in
+// order, so a repeated key keeps its last value. With threads > 1 and at
+// least 65536 pairs, hashing and placing the pairs is split over that many
+// threads, which then call the key handler's hash and equal, the copy
+// handlers and the table's allocator concurrently: all of them must be
+// thread-safe, which rules out a hash_arena. Returns NULL if the table
+// cannot be created or a pair cannot be stored.
+HashTable *hash_table_build_parallel(type_handler key_handler,
+                                     type_handler value_handler,
+                                     const hash_table_options *options,
+                                     const void *const *keys,
+                                     const void *const *values, size_t n,
+                                     size_t threads);
+
 size_t hash_table_count(const HashTable *table);
+// Number of slots currently allocated.
+size_t hash_table_capacity(const HashTable *table);
+// Grows the table, or drops its tombstones, if needed, so that it holds
+// `entries` entries without resizing or rehashing again. A table with
+// max_entries already has room for all of them and does not grow past it.
+// Returns false if the memory cannot be allocated.
+bool hash_table_reserve(HashTable *table, size_t entries);
+// Shrinks the slot arrays to the smallest capacity that fits the current
+// entries, and drops tombstones. A table with max_entries only drops its
+// tombstones. Returns false if the smaller arrays cannot
+// be allocated, leaving the table as it was.
+bool hash_table_shrink_to_fit(HashTable *table);
+// Turns the table into a read-only one packed for lookups: its entries are
+// moved into a ROBIN_HOOD layout at a load of about 0.95, whatever engine
+// it was created with, with no tombstones and no power-of-two rounding.
+// Entries sit in the order of their home slots, so a lookup reads a short
+// run of control bytes and one or two cache lines of entries, hit or miss.
+// From then on every function that would modify the table fails, as for a
+// read-only snapshot, and hash_table_save() writes the packed layout. Tables
+// behind the HT_DEFINE() maps must not be frozen, since those probe the
+// LINEAR layout themselves. Finishes any incremental resize in progress
+// first. Returns false, leaving the table as it was, if the memory cannot
+// be allocated or the hashes crowd too many keys onto one slot.
+bool hash_table_freeze(HashTable *table);
+// Moves the entries of up to max_slots slots of an incremental resize in
+// progress, for spending idle time on it. Returns whether the resize is
+// still in progress.
+bool hash_table_resize_step(HashTable *table, size_t max_slots);
+
+// Walks every entry in slot order, reading the slot arrays sequentially.
+// Create with hash_table_iter(); the fields are private. The table must not
+// be modified while an iterator over it is in use.
+typedef struct {
+  const HashTable *table;
+  const HashTable *arrays; // the table, or its resize source
+  size_t index;
+} hash_table_iterator;
+
+hash_table_iterator hash_table_iter(const HashTable *table);
+// Advances to the next entry and returns true, or returns false when all
+// have been visited. key and value, either of which may be NULL, receive
+// what a lookup would return: the stored pointers, or pointers into the
+// table for inline data. Nothing is copied.
+bool hash_table_iter_next(hash_table_iterator *it, void **key, void **value);
+
+// Called by hash_table_scan() for each entry, with the same borrowed
+// pointers as hash_table_iter_next(). Must not modify the table.
+typedef void (*scan_function)(void *key, void *value, void *ctx);
+
+// Visits a slice of the table, calling fn on each entry found, and returns
+// the cursor to pass to the next call. Start with cursor 0; a returned 0
+// means the scan is complete. The table may be modified between calls,
+// including resized: every entry present for the whole scan is visited at
+// least once, though entries may be visited more than once while the table
+// grows or shrinks. Uses the reverse-binary cursor of Redis' SCAN over home
+// buckets.
+size_t hash_table_scan(const HashTable *table, size_t cursor, scan_function fn,
+                       void *ctx);
+
+// Operations whose probe lengths hash_table_get_stats() reports.
+typedef enum {
+  HASH_TABLE_OP_LOOKUP,
+  HASH_TABLE_OP_INSERT,
+  HASH_TABLE_OP_DELETE,
+  HASH_TABLE_OP_COUNT,
+} hash_table_op;
+
+// Probe length buckets: bucket i counts probes that examined from 2^i to
+// 2^(i+1) - 1 slots (groups of 16 for SWISS); the last one also counts
+// everything longer. Bucket 0 includes probes that examined none.
+#define HASH_TABLE_PROBE_BUCKETS 16
+
+typedef struct {
+  size_t count;
+  size_t capacity;
+  size_t tombstones;
+  double load_factor; // count / capacity
+  bool resizing;      // an incremental resize is in progress
+  size_t bytes;       // charged towards max_bytes
+  uint64_t evictions; // entries evicted to stay within the bounds
+  uint64_t expirations; // expired entries reclaimed
+  // The fields below are only collected when the library is built with
+  // HASH_TABLE_STATS defined (make STATS=1); otherwise counters is false
+  // and they are all zero. Lookups on the same table from several threads
+  // all update the same counters.
+  bool counters;
+  uint64_t probe_lengths[HASH_TABLE_OP_COUNT][HASH_TABLE_PROBE_BUCKETS];
+  uint64_t hash_calls;  // key handler hash calls
+  uint64_t equal_calls; // key handler equal calls
+  uint64_t resizes;     // arrays reallocated, including incremental starts
+  uint64_t resize_ns;   // time spent in those reallocations
+  uint64_t rehashes;    // in-place rehashes to drop tombstones
+} hash_table_stats;
+
+// Fills stats with the table's current shape and, in a stats build, the
+// counters gathered since creation or the last hash_table_reset_stats().
+void hash_table_get_stats(const HashTable *table, hash_table_stats *stats);
+void hash_table_reset_stats(HashTable *table);
+
+// Writes the table to path as a snapshot that hash_table_open_mmap() can
+// map back in without rebuilding it. Only tables with inline keys and
+// values (key_size and value_size both set) can be saved, since pointers
+// would mean nothing to another process, and only unbounded ones without
+// expiry. The file holds the slot arrays as they are, at offsets from its
+// start, so it is only readable on machines with the same byte order. It
+// is written next to path and renamed into place, so a reader never sees a
+// partial snapshot. Finishes any incremental resize in progress first.
+// Returns false if the table cannot be saved or the file cannot be
+// written.
+bool hash_table_save(HashTable *table, const char *path);
+
+// Opens a snapshot written by hash_table_save() and serves lookups
+// straight from the mapped file: nothing is read or rebuilt up front, and
+// pages are loaded as lookups touch them. key_handler must hash and
+// compare keys exactly as the one of the saved table did, or lookups will
+// not find them. With copy_on_write false the file is mapped read-only and
+// every function that would modify the table fails. With copy_on_write the
+// table can be modified like any other; changes stay private to the
+// process and never reach the file, and the first resize moves the table
+// into the heap. Snapshots of frozen tables open read-only and frozen
+// either way. Returns NULL if the file is missing, truncated or not a
+// snapshot of this version.
+HashTable *hash_table_open_mmap(const char *path, type_handler key_handler,
+                                bool copy_on_write);
+
+// Writes every entry to writer: a short header with the entry count, then
+// each key and value. Inline keys and values are written as their bytes,
+// pointer ones through the handler's encode hook. Writes are gathered into
+// chunks of a few KiB, so the sink is called far less often than once per
+// entry. Returns false, having possibly written part of the stream, if a
+// write fails or a pointer side has no encode hook.
+bool hash_table_serialize_stream(const HashTable *table,
+                                 const hash_table_writer *writer);
+// Reads a stream written by hash_table_serialize_stream() into table,
+// which must store keys and values the way the serialized table did, and
+// may already hold entries. The table is grown ahead of each batch of
+// 65536 entries rather than for the whole count the stream claims, so a
+// corrupt count cannot make it allocate more than one batch past what the
+// stream actually holds. Decoded
+// keys and values are stored as with hash_table_insert_owned(). Returns
+// false if the stream is malformed, a read fails or memory runs out; the
+// entries read up to that point stay in the table.
+bool hash_table_deserialize_stream(HashTable *table,
+                                   const hash_table_reader *reader);
+
+// Bump allocator that hands out memory from large blocks and frees all of
+// it at once. Small frees are ignored unless they undo the latest
+// allocation; allocations of at least a quarter of the block size get a
+// block of their own, which free() returns immediately. Alignments above
+// 64 bytes are not supported. Not thread-safe.
+typedef struct hash_arena hash_arena;
+
+// block_size 0 selects 64 KiB.
+hash_arena *hash_arena_create(size_t block_size);
+void hash_arena_destroy(hash_arena *arena);
+// Frees every allocation at once, keeping the arena usable.
+void hash_arena_reset(hash_arena *arena);
+// An allocator drawing from arena, whose release resets it. Pass it as
+// hash_table_options.allocator for a table whose keys, values and slot
+// arrays are all freed by a single reset when the table is destroyed.
+context_allocator hash_arena_allocator(hash_arena *arena);
+
+// Allocator for the slot arrays of very large tables. Allocations of at
+// least min_size bytes are mapped straight from the kernel on huge pages,
+// so random lookups take far fewer TLB misses, and can be bound to or
+// interleaved across NUMA nodes. Smaller ones, such as the table struct
+// and handler copies, come from malloc(). Thread-safe, so a sharded table
+// may share one between shards. Linux only.
+typedef enum {
+  // Normal pages starting on a 2 MiB boundary, with madvise(MADV_HUGEPAGE)
+  // so that transparent huge pages back them when the kernel has any.
+  HASH_PAGES_TRANSPARENT = 0,
+  // Pages from the reserved pool (vm.nr_hugepages, or the 1 GiB pool set
+  // up at boot), falling back to HASH_PAGES_TRANSPARENT when it runs out
+  // unless require_hugetlb is set. Mappings are rounded up to whole pages.
+  HASH_PAGES_HUGE_2MB,
+  HASH_PAGES_HUGE_1GB,
+} hash_pages_size;
+
+typedef enum {
+  HASH_PAGES_NUMA_DEFAULT = 0, // the process's own policy
+  HASH_PAGES_NUMA_BIND,        // only the nodes in numa_nodes
+  HASH_PAGES_NUMA_INTERLEAVE,  // page by page across numa_nodes
+} hash_pages_numa_policy;
+
+typedef struct {
+  hash_pages_size page_size;
+  bool require_hugetlb;
+  hash_pages_numa_policy numa_policy;
+  // Bit n selects node n. Required for BIND; 0 with INTERLEAVE selects
+  // every online node.
+  uint64_t numa_nodes;
+  // Smallest allocation to map. 0 selects 1 MiB.
+  size_t min_size;
+} hash_pages_options;
+
+typedef struct hash_pages hash_pages;
+
+// options may be NULL for transparent huge pages and no NUMA policy.
+// Returns NULL if the options are invalid.
+hash_pages *hash_pages_create(const hash_pages_options *options);
+// Every table using the allocator must have been destroyed first.
+void hash_pages_destroy(hash_pages *pages);
+context_allocator hash_pages_allocator(hash_pages *pages);
+// Bytes currently mapped, and how many mappings fell back from the huge
+// page pool to transparent huge pages. Either pointer may be NULL.
+void hash_pages_usage(const hash_pages *pages, size_t *mapped,
+                      size_t *fallbacks);
 
 #endif
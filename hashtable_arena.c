@@ -0,0 +1,140 @@
+#include "hashtable.h"
+#include <stdlib.h>
+
+#define DEFAULT_BLOCK_SIZE (64 * 1024)
+#define MAX_ALIGNMENT 64
+
+// Every block starts with this header, padded so that the data after it is
+// MAX_ALIGNMENT aligned. Blocks form a doubly linked list so that a large
+// allocation's dedicated block can be unlinked when it is freed.
+struct arena_block {
+  struct arena_block *prev;
+  struct arena_block *next;
+  size_t size; // usable bytes after the header
+};
+
+#define HEADER_SIZE                                                            \
+  ((sizeof(struct arena_block) + MAX_ALIGNMENT - 1) &                          \
+   ~(size_t)(MAX_ALIGNMENT - 1))
+
+struct hash_arena {
+  size_t block_size;
+  struct arena_block *blocks;  // all blocks, most recent first
+  struct arena_block *current; // block that small allocations bump from
+  size_t used;                 // bytes used in current
+  void *last;                  // latest small allocation, for undoing it
+};
+
+static unsigned char *block_data(struct arena_block *block) {
+  return (unsigned char *)block + HEADER_SIZE;
+}
+
+static struct arena_block *new_block(hash_arena *arena, size_t size) {
+  struct arena_block *block =
+      aligned_alloc(MAX_ALIGNMENT, (HEADER_SIZE + size + MAX_ALIGNMENT - 1) &
+                                       ~(size_t)(MAX_ALIGNMENT - 1));
+  if (!block)
+    return NULL;
+  block->size = size;
+  block->prev = NULL;
+  block->next = arena->blocks;
+  if (arena->blocks)
+    arena->blocks->prev = block;
+  arena->blocks = block;
+  return block;
+}
+
+static bool is_large(const hash_arena *arena, size_t size) {
+  return size >= arena->block_size / 4;
+}
+
+hash_arena *hash_arena_create(size_t block_size) {
+  hash_arena *arena = malloc(sizeof(hash_arena));
+  if (!arena)
+    return NULL;
+  arena->block_size = block_size ? block_size : DEFAULT_BLOCK_SIZE;
+  arena->blocks = NULL;
+  arena->current = NULL;
+  arena->used = 0;
+  arena->last = NULL;
+  return arena;
+}
+
+void hash_arena_reset(hash_arena *arena) {
+  struct arena_block *block = arena->blocks;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena->blocks = NULL;
+  arena->current = NULL;
+  arena->used = 0;
+  arena->last = NULL;
+}
+
+void hash_arena_destroy(hash_arena *arena) {
+  if (!arena)
+    return;
+  hash_arena_reset(arena);
+  free(arena);
+}
+
+static void *arena_alloc(void *ctx, size_t size, size_t alignment) {
+  hash_arena *arena = ctx;
+  if (alignment > MAX_ALIGNMENT)
+    return NULL;
+  if (size == 0)
+    size = 1;
+
+  if (is_large(arena, size)) {
+    struct arena_block *block = new_block(arena, size);
+    return block ? block_data(block) : NULL;
+  }
+
+  size_t offset = (arena->used + alignment - 1) & ~(alignment - 1);
+  if (!arena->current || offset + size > arena->current->size) {
+    arena->current = new_block(arena, arena->block_size);
+    if (!arena->current)
+      return NULL;
+    offset = 0;
+  }
+  void *ptr = block_data(arena->current) + offset;
+  arena->used = offset + size;
+  arena->last = ptr;
+  return ptr;
+}
+
+static void arena_free(void *ctx, void *ptr, size_t size) {
+  hash_arena *arena = ctx;
+  if (!ptr)
+    return;
+  if (size == 0)
+    size = 1;
+
+  if (is_large(arena, size)) {
+    struct arena_block *block =
+        (struct arena_block *)((unsigned char *)ptr - HEADER_SIZE);
+    if (block->prev) {
+      block->prev->next = block->next;
+    } else {
+      arena->blocks = block->next;
+    }
+    if (block->next)
+      block->next->prev = block->prev;
+    free(block);
+    return;
+  }
+
+  // Only the most recent allocation can be given back.
+  if (ptr == arena->last) {
+    arena->used = (size_t)((unsigned char *)ptr - block_data(arena->current));
+    arena->last = NULL;
+  }
+}
+
+static void arena_release(void *ctx) { hash_arena_reset(ctx); }
+
+context_allocator hash_arena_allocator(hash_arena *arena) {
+  return (context_allocator){arena_alloc, arena_free, arena_release, arena};
+}
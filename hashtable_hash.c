@@ -0,0 +1,187 @@
+#include "hashtable_internal.h"
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC 1
+#endif
+
+// wyhash's default secret: odd constants with 32 bits set in each.
+static const uint64_t secret[4] = {0xa0761d6478bd642fULL,
+                                   0xe7037ed1a0b428dbULL,
+                                   0x8ebc6af09c88c6e3ULL,
+                                   0x589965cc75374cc3ULL};
+
+// Replaces *a and *b with the low and high halves of their 128-bit product.
+static inline void multiply(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t a_hi = *a >> 32, a_lo = (uint32_t)*a;
+  uint64_t b_hi = *b >> 32, b_lo = (uint32_t)*b;
+  uint64_t hh = a_hi * b_hi, hl = a_hi * b_lo;
+  uint64_t lh = a_lo * b_hi, ll = a_lo * b_lo;
+  uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+  *a = (mid << 32) | (uint32_t)ll;
+  *b = hh + (hl >> 32) + (lh >> 32) + (mid >> 32);
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+// Unaligned native-endian reads: inline keys need not be 8-byte aligned.
+static inline uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// 1 to 3 bytes, each of them read at least once.
+static inline uint64_t read_small(const uint8_t *p, size_t size) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+}
+
+uint64_t hash_table_hash_u64(const void *key, size_t size, uint64_t seed) {
+  (void)size;
+  uint64_t a = read64(key) ^ secret[0];
+  uint64_t b = seed ^ secret[1];
+  multiply(&a, &b);
+  return mix(a ^ secret[0], b ^ secret[1]);
+}
+
+// wyhash (final version 4). Keys of up to 16 bytes take two overlapping
+// reads and two multiplies; longer ones are consumed 16 bytes, or 48 in
+// three independent lanes, per step.
+uint64_t hash_table_hash_bytes(const void *key, size_t size, uint64_t seed) {
+  const uint8_t *p = key;
+  uint64_t a = 0, b = 0;
+  seed ^= mix(seed ^ secret[0], secret[1]);
+  if (size <= 16) {
+    if (size >= 4) {
+      size_t step = (size >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + step);
+      b = (read32(p + size - 4) << 32) | read32(p + size - 4 - step);
+    } else if (size > 0) {
+      a = read_small(p, size);
+    }
+  } else {
+    size_t left = size;
+    if (left > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+        seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+        seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+        p += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (left > 16) {
+      seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    // The last 16 bytes, overlapping the ones already mixed in.
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  multiply(&a, &b);
+  return mix(a ^ secret[0] ^ size, b ^ secret[1]);
+}
+
+uint64_t hash_table_hash_string(const void *key, size_t size, uint64_t seed) {
+  (void)size;
+  return hash_table_hash_bytes(key, strlen(key), seed);
+}
+
+// CRC32C (Castagnoli) a nibble at a time, for CPUs without the instruction.
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *p, size_t size) {
+  static const uint32_t nibbles[16] = {
+      0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3,
+      0x61c69362, 0x7198540d, 0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9,
+      0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75};
+  for (size_t i = 0; i < size; i++) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ nibbles[crc & 15];
+    crc = (crc >> 4) ^ nibbles[crc & 15];
+  }
+  return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t size) {
+  uint64_t wide = crc;
+  for (; size >= 8; p += 8, size -= 8)
+    wide = _mm_crc32_u64(wide, read64(p));
+  crc = (uint32_t)wide;
+  for (; size > 0; p++, size--)
+    crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+#endif
+
+#ifdef HAVE_ARM_CRC
+static uint32_t crc32c_arm(uint32_t crc, const uint8_t *p, size_t size) {
+  for (; size >= 8; p += 8, size -= 8)
+    crc = __crc32cd(crc, read64(p));
+  for (; size > 0; p++, size--)
+    crc = __crc32cb(crc, *p);
+  return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t size) {
+#if defined(HAVE_SSE42_CRC)
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32c_sse42(crc, p, size);
+#elif defined(HAVE_ARM_CRC)
+  return crc32c_arm(crc, p, size);
+#endif
+  return crc32c_software(crc, p, size);
+}
+
+// The CRC only has 32 bits, so it is widened with the size and seed and
+// then mixed, for the top and bottom bits the engines split a hash into.
+uint64_t hash_table_hash_crc32c(const void *key, size_t size, uint64_t seed) {
+  uint32_t crc = crc32c((uint32_t)seed, key, size);
+  return ht_mix_hash((((uint64_t)crc << 32) | (uint32_t)size) ^ seed);
+}
+
+uint64_t hash_table_random_seed(void) {
+  uint64_t seed = 0;
+  FILE *file = fopen("/dev/urandom", "rb");
+  if (file) {
+    setvbuf(file, NULL, _IONBF, 0);
+    if (fread(&seed, sizeof(seed), 1, file) != 1)
+      seed = 0;
+    fclose(file);
+  }
+  // Without a random source, fall back to what changes from run to run.
+  if (seed == 0) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    seed = hash_table_hash_u64(&(uint64_t){(uint64_t)ts.tv_nsec},
+                               sizeof(uint64_t),
+                               (uint64_t)ts.tv_sec ^ (uintptr_t)&seed);
+  }
+  return seed;
+}
@@ -0,0 +1,481 @@
+#ifndef CUSTOM_HASH_TABLE_INTERNAL_H
+#define CUSTOM_HASH_TABLE_INTERNAL_H
+
+// Table layout shared by hashtable.c and the alternate probing engines. Not
+// part of the public API.
+
+#include "hashtable.h"
+#include <stdatomic.h>
+#include <string.h>
+
+// Murmur3's 64-bit finalizer. Applied to every user hash so that weak
+// hashes still spread over the low bits used to pick a slot, and over the
+// top and bottom bits the swiss engine splits a hash into.
+static inline uint64_t ht_mix_hash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+#ifdef HASH_TABLE_STATS
+// Counters behind hash_table_get_stats(). Lookups may run concurrently
+// under a reader lock, so they are updated with relaxed atomics.
+struct ht_stats {
+  _Atomic uint64_t probe_lengths[HASH_TABLE_OP_COUNT]
+                                [HASH_TABLE_PROBE_BUCKETS];
+  _Atomic uint64_t hash_calls;
+  _Atomic uint64_t equal_calls;
+  _Atomic uint64_t resizes;
+  _Atomic uint64_t resize_ns;
+  _Atomic uint64_t rehashes;
+};
+
+// Slots, or groups for SWISS, examined by the calling thread's finds since
+// it was last reset. The find functions add to it and the operation that
+// called them files the total under its probe length histogram.
+extern _Thread_local size_t ht_stats_probes;
+
+#define HT_STATS_ADD(table, counter, n)                                        \
+  atomic_fetch_add_explicit(&(table)->stats->counter, (n),                     \
+                            memory_order_relaxed)
+#define HT_STATS_PROBES(n) (ht_stats_probes += (n))
+#else
+#define HT_STATS_ADD(table, counter, n) ((void)0)
+#define HT_STATS_PROBES(n) ((void)0)
+#endif
+
+// A key's hash as the engines use it: a seeded hash as it is, or the plain
+// one through ht_mix_hash().
+static inline uint64_t ht_hash_with(const type_handler *handler,
+                                    const void *key, size_t key_size,
+                                    uint64_t seed) {
+  if (handler->hash_with_seed)
+    return handler->hash_with_seed(key, key_size, seed);
+  return ht_mix_hash(handler->hash(key));
+}
+
+// Rounds size up to alignment, a power of two.
+static inline size_t ht_align_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Smallest power-of-two capacity, no lower than minimum, that holds
+// entries without exceeding max_load_factor. Returns 0 if no such capacity
+// fits in a size_t.
+static inline size_t ht_capacity_for(size_t entries, size_t minimum,
+                                     double max_load_factor) {
+  size_t capacity = minimum;
+  while (entries > capacity * max_load_factor) {
+    if (capacity > SIZE_MAX / 2)
+      return 0;
+    capacity *= 2;
+  }
+  return capacity;
+}
+
+// Copies and destroys pointer keys and values through their handler,
+// giving the *_with_allocator variants the table's allocator.
+static inline void *ht_copy_with(const type_handler *handler,
+                                 const context_allocator *allocator,
+                                 const void *data) {
+  if (handler->copy_with_allocator)
+    return handler->copy_with_allocator(data, allocator);
+  return handler->copy(data);
+}
+
+static inline void ht_destroy_with(const type_handler *handler,
+                                   const context_allocator *allocator,
+                                   void *data) {
+  if (handler->destroy_with_allocator) {
+    handler->destroy_with_allocator(data, allocator);
+  } else if (handler->destroy) {
+    handler->destroy(data);
+  }
+}
+
+// The allocator tables use when none is given: malloc(), or
+// aligned_alloc() for alignments above that of max_align_t.
+context_allocator ht_default_allocator(void);
+
+// Returned by the find functions when the key is not present.
+#define SLOT_NONE ((size_t)-1)
+
+// Explicit max_load_factor values below this are refused: each insert
+// past it doubles the table, which runs away at tiny factors.
+#define HT_MIN_LOAD_FACTOR 0.25
+
+// Whether max_load_factor is 0, for the engine's default, or within
+// [HT_MIN_LOAD_FACTOR, 1). Written so that NaN fails.
+static inline bool ht_load_factor_valid(double max_load_factor) {
+  return max_load_factor == 0 ||
+         (max_load_factor >= HT_MIN_LOAD_FACTOR && max_load_factor < 1);
+}
+
+// Slots a SWISS probe reads the control bytes of at once, and so the
+// smallest capacity a SWISS table can have.
+#define HT_SWISS_GROUP_WIDTH 16
+
+// Inline keys and values are stored at this alignment within an entry.
+#define INLINE_ALIGNMENT 8
+
+// Alignment requested for the table's own allocations.
+#define ALLOC_ALIGNMENT _Alignof(max_align_t)
+
+// With separate_values, where the entries allocation and its value array
+// start.
+#define VALUES_ALIGNMENT 64
+
+// Kept in every entry of a bounded table, between the key and the value,
+// so that it moves with the entry.
+struct ht_entry_meta {
+  // Set by accesses, which may run concurrently under a reader lock, and
+  // cleared by the clock hand.
+  _Atomic uint8_t referenced;
+  uint32_t charge; // towards max_bytes
+};
+
+struct HashTable {
+  type_handler key_handler;
+  type_handler value_handler;
+  context_allocator alloc_handler;
+  allocator legacy_allocator; // backs alloc_handler for custom_allocator
+  hash_table_engine engine;
+  double max_load_factor;
+  bool cache_hashes;
+  size_t resize_threads; // for resize(); 0 or 1 resizes serially
+  uint64_t seed;   // for key_handler.hash_with_seed
+  size_t capacity; // a power of two unless frozen
+  size_t count;
+  size_t tombstones;
+  // Engine specific: 2-bit slot states for LINEAR, one byte per slot for
+  // SWISS and ROBIN_HOOD.
+  uint8_t *control_bytes;
+  // One entry per slot: the key, then the value at value_offset. Each is
+  // either stored inline (key_size/value_size bytes) or, when its size is
+  // 0, as a pointer to a copy made by the type handler. With
+  // separate_values an entry is only the key, and the values follow all of
+  // the keys in the same allocation, so probes never load them.
+  size_t key_size;
+  size_t value_size;
+  size_t value_offset;
+  size_t entry_size;
+  bool separate_values;
+  size_t value_stride; // entry_size, or the value slot size
+  unsigned char *entries;
+  unsigned char *values; // value of slot 0, set by ht_set_entries()
+  uint64_t *hashes; // mixed hashes; NULL unless created with cache_hashes
+  // Set while an incremental resize moves entries out of the previous slot
+  // arrays, which old_table describes; NULL otherwise. An entry lives in
+  // exactly one of the two, and count covers only the current arrays.
+  bool incremental_resize;
+  HashTable *old_table;
+  size_t migrate_index; // next slot of old_table to move
+  // Set for tables with max_entries or max_bytes, whose entries then hold
+  // a struct ht_entry_meta at meta_offset.
+  bool bounded;
+  size_t meta_offset;
+  size_t max_entries;
+  size_t max_bytes;
+  size_t bytes; // sum of the entries' charges
+  size_t (*entry_bytes)(const void *key, const void *value);
+  evict_function on_evict;
+  void *evict_ctx;
+  size_t clock_hand; // next slot the eviction sweep looks at
+  uint64_t evictions;
+  // Set for tables created with expiry, whose entries then hold a 32-bit
+  // deadline in expiry_clock seconds at deadline_offset, 0 for none.
+  bool expiry;
+  size_t deadline_offset;
+  expiry_clock_function expiry_clock;
+  void *expiry_ctx;
+  size_t expire_cursor; // next slot hash_table_expire_step() looks at
+  uint64_t expirations;
+  // Set for tables opened with hash_table_open_mmap(): the mapped snapshot
+  // file, which the slot arrays point into until the first resize, and
+  // whether it is mapped read-only, in which case nothing may be modified.
+  void *mapping;
+  size_t mapping_size;
+  bool read_only;
+  // Set by hash_table_freeze(), which also sets read_only: the number of
+  // home slots of the packed ROBIN_HOOD layout. The slots after them take
+  // the entries that overflow the last homes, then HT_FROZEN_TAIL empty
+  // ones, so probes never wrap, and capacity is no longer a power of two.
+  // 0 for tables that are not frozen.
+  size_t frozen_buckets;
+#ifdef HASH_TABLE_STATS
+  // Shared with old_table, so finds in either count towards the table.
+  struct ht_stats *stats;
+#endif
+};
+
+static inline unsigned char *ht_entry(const HashTable *table, size_t index) {
+  return table->entries + index * table->entry_size;
+}
+
+// The value slot of index: the inline bytes, or where the pointer is kept.
+static inline unsigned char *ht_value_slot(const HashTable *table,
+                                           size_t index) {
+  return table->values + index * table->value_stride;
+}
+
+// Offset of the first value from entries, for arrays of capacity slots.
+static inline size_t ht_values_offset(const HashTable *table,
+                                      size_t capacity) {
+  if (!table->separate_values)
+    return table->value_offset;
+  return (table->entry_size * capacity + VALUES_ALIGNMENT - 1) &
+         ~(size_t)(VALUES_ALIGNMENT - 1);
+}
+
+// Bytes in an entries allocation of capacity slots, values included.
+static inline size_t ht_entries_size(const HashTable *table,
+                                     size_t capacity) {
+  if (!table->separate_values)
+    return table->entry_size * capacity;
+  return ht_values_offset(table, capacity) + table->value_stride * capacity;
+}
+
+static inline void ht_set_entries(HashTable *table, unsigned char *entries,
+                                  size_t capacity) {
+  table->entries = entries;
+  table->values = entries + ht_values_offset(table, capacity);
+}
+
+static inline struct ht_entry_meta *ht_entry_meta(const HashTable *table,
+                                                  size_t index) {
+  return (struct ht_entry_meta *)(ht_entry(table, index) +
+                                  table->meta_offset);
+}
+
+static inline uint32_t *ht_entry_deadline(const HashTable *table,
+                                          size_t index) {
+  return (uint32_t *)(ht_entry(table, index) + table->deadline_offset);
+}
+
+// The key as handed to the key handler: the inline bytes, or the stored
+// pointer.
+static inline void *ht_entry_key(const HashTable *table, size_t index) {
+  unsigned char *slot = ht_entry(table, index);
+  return table->key_size ? (void *)slot : *(void **)slot;
+}
+
+static inline void *ht_entry_value(const HashTable *table, size_t index) {
+  unsigned char *slot = ht_value_slot(table, index);
+  return table->value_size ? (void *)slot : *(void **)slot;
+}
+
+// Calls equal, the key handler's or the one passed to a pre-hashed lookup,
+// with the key in slot index and key.
+static inline bool ht_key_equal(const HashTable *table,
+                                key_equal_function equal, size_t index,
+                                const void *key) {
+  HT_STATS_ADD(table, equal_calls, 1);
+  return equal(ht_entry_key(table, index), key);
+}
+
+static inline void *ht_alloc(const HashTable *table, size_t size) {
+  return table->alloc_handler.alloc(table->alloc_handler.ctx, size,
+                                    ALLOC_ALIGNMENT);
+}
+
+static inline void ht_free(const HashTable *table, void *ptr, size_t size) {
+  table->alloc_handler.free(table->alloc_handler.ctx, ptr, size);
+}
+
+// Copies the key and value of slot src of from into slot dst of to. The
+// tables must share a layout, as a table and its old_table do.
+static inline void ht_copy_entry(HashTable *to, size_t dst,
+                                 const HashTable *from, size_t src) {
+  memcpy(ht_entry(to, dst), ht_entry(from, src), to->entry_size);
+  if (to->separate_values)
+    memcpy(ht_value_slot(to, dst), ht_value_slot(from, src),
+           to->value_stride);
+}
+
+// Zeroes the key and value of slot index.
+static inline void ht_clear_entry(HashTable *table, size_t index) {
+  memset(ht_entry(table, index), 0, table->entry_size);
+  if (table->separate_values)
+    memset(ht_value_slot(table, index), 0, table->value_stride);
+}
+
+// Moves an entry, with its cached hash, to another slot of the same table.
+static inline void ht_move_entry(HashTable *table, size_t dst, size_t src) {
+  ht_copy_entry(table, dst, table, src);
+  if (table->hashes)
+    table->hashes[dst] = table->hashes[src];
+}
+
+// 2-bit slot states of the linear engine, four slots per control byte.
+#define HT_STATE_EMPTY 0b00
+#define HT_STATE_OCCUPIED 0b01
+#define HT_STATE_DELETED 0b10
+
+static inline uint8_t ht_linear_state(const HashTable *table, size_t index) {
+  size_t byte_index = index / 4;
+  size_t bit_offset = (index % 4) * 2;
+  return (table->control_bytes[byte_index] >> bit_offset) & 0b11;
+}
+
+// Whether the occupied slot index holds key.
+typedef bool (*ht_match_function)(const HashTable *table, size_t index,
+                                  const void *key, uint64_t hash);
+
+// The linear engine's find, with the key comparison passed in. hashtable.c
+// uses the key handler; the typed tables of hashtable_typed.h pass their
+// own comparison, which the compiler inlines along with this loop.
+static inline size_t ht_linear_find_with(const HashTable *table,
+                                         const void *key, uint64_t hash,
+                                         size_t *insert_index,
+                                         ht_match_function match) {
+  size_t mask = table->capacity - 1;
+  size_t index = hash & mask;
+  size_t tombstone_index = SLOT_NONE;
+
+  for (size_t probes = 0; probes < table->capacity; probes++) {
+    uint8_t state = ht_linear_state(table, index);
+    switch (state) {
+    case HT_STATE_EMPTY:
+      HT_STATS_PROBES(probes + 1);
+      if (insert_index) {
+        *insert_index = tombstone_index != SLOT_NONE ? tombstone_index : index;
+      }
+      return SLOT_NONE;
+    case HT_STATE_DELETED:
+      if (tombstone_index == SLOT_NONE) {
+        tombstone_index = index;
+      }
+      break;
+    case HT_STATE_OCCUPIED:
+      if (match(table, index, key, hash)) {
+        HT_STATS_PROBES(probes + 1);
+        return index;
+      }
+      break;
+    }
+    index = (index + 1) & mask;
+  }
+
+  HT_STATS_PROBES(table->capacity);
+  if (insert_index) {
+    *insert_index = tombstone_index;
+  }
+  return SLOT_NONE;
+}
+
+// Entry points for callers that have already hashed the key, such as the
+// sharded table. hash is the mixed hash returned by ht_hash_key().
+uint64_t ht_hash_key(const HashTable *table, const void *key);
+bool ht_insert_hashed(HashTable *table, const void *key, uint64_t hash,
+                      const void *value);
+void *ht_lookup_hashed(const HashTable *table, const void *key, uint64_t hash);
+bool ht_delete_hashed(HashTable *table, const void *key, uint64_t hash);
+// For callers that have already probed for the key themselves, in tables
+// without incremental_resize. ht_insert_absent() adds a key known not to
+// be present; ht_erase() removes the entry in slot index.
+bool ht_insert_absent(HashTable *table, const void *key, uint64_t hash,
+                      const void *value);
+void ht_erase(HashTable *table, size_t index);
+
+// Frees data of one side of an entry through its handler.
+void ht_destroy_data(const HashTable *table, const type_handler *handler,
+                     void *data);
+
+// Slot array access for hashtable_snapshot.c. ht_set_slots() frees the
+// table's current arrays and installs the given ones in their place.
+size_t ht_control_size(const HashTable *table, size_t capacity);
+bool ht_is_occupied(const HashTable *table, size_t index);
+void ht_set_slots(HashTable *table, size_t capacity, uint8_t *control_bytes,
+                  unsigned char *entries, uint64_t *hashes);
+// Unmaps the snapshot of a table from hash_table_open_mmap().
+void ht_unmap_snapshot(HashTable *table);
+
+// Each engine provides the same set of slot operations:
+//   home:        slot where the probe sequence for a hash starts (only the
+//                swiss engine needs its own).
+//   find:        index of key, compared by equal, or SLOT_NONE. When not
+//                found and insert_index is non-NULL, it receives the slot
+//                the key should go into.
+//   find_free:   insertion slot for a key known to be absent; no equality
+//                checks, used when moving entries during resize.
+//   find_local:  like find, but never probes past slot end, nor for the
+//                swiss engine past the home group, so that threads filling
+//                different ranges of new arrays do not touch each other's
+//                slots. A NULL key is known to be absent and is not
+//                compared. insert_index receives SLOT_NONE when the key
+//                would have to go beyond that range. Only for arrays
+//                without tombstones.
+//   occupy:      marks a slot returned by find/find_free as holding hash.
+//                Robin Hood shifts later entries along to make room, and
+//                fails if that would move one too far from home.
+//   release:     marks an occupied slot as free again. Robin Hood shifts
+//                later entries back into it.
+//   is_occupied: whether a slot holds an entry.
+//   is_deleted:  whether a slot is a tombstone.
+//   clear:       sets a slot to empty without tombstone bookkeeping.
+//   mark_for_rehash: turns tombstones into empty slots and occupied slots
+//                into tombstones, ahead of an in-place rehash.
+//   scan_buckets: number of buckets hash_table_scan() walks, a power of two
+//                that doubles with the capacity: one per home slot, or per
+//                home group for the swiss engine.
+//   scan_bucket: calls fn on every entry whose probe sequence starts in
+//                the given bucket.
+// occupy and release keep table->tombstones up to date.
+// Entries and cached hashes are written by the caller. Hashes passed to the
+// engines have already gone through ht_mix_hash().
+
+size_t ht_swiss_control_size(size_t capacity);
+void ht_swiss_init_control(uint8_t *control_bytes, size_t capacity);
+size_t ht_swiss_home(const HashTable *table, uint64_t hash);
+size_t ht_swiss_find(const HashTable *table, const void *key,
+                     key_equal_function equal, uint64_t hash,
+                     size_t *insert_index);
+size_t ht_swiss_find_free(const HashTable *table, uint64_t hash);
+size_t ht_swiss_find_local(const HashTable *table, const void *key,
+                           key_equal_function equal, uint64_t hash,
+                           size_t *insert_index);
+void ht_swiss_occupy(HashTable *table, size_t index, uint64_t hash);
+void ht_swiss_release(HashTable *table, size_t index);
+bool ht_swiss_is_occupied(const HashTable *table, size_t index);
+bool ht_swiss_is_deleted(const HashTable *table, size_t index);
+void ht_swiss_clear(HashTable *table, size_t index);
+void ht_swiss_mark_for_rehash(HashTable *table);
+size_t ht_swiss_scan_buckets(const HashTable *table);
+void ht_swiss_scan_bucket(const HashTable *table, size_t bucket,
+                          scan_function fn, void *ctx);
+
+// Longest distance from its home slot a ROBIN_HOOD entry may have, so that
+// 1 + distance fits in its control byte.
+#define HT_ROBIN_MAX_DISTANCE 254
+
+// Empty slots at the end of a frozen table: enough for a probe that reads
+// the control bytes of 16 slots at a time to stay within the array.
+#define HT_FROZEN_TAIL 16
+
+// Home slot of hash in a frozen table: the hash scaled to frozen_buckets,
+// which need not be a power of two, by its top bits.
+static inline size_t ht_frozen_home(const HashTable *table, uint64_t hash) {
+  return (size_t)(((unsigned __int128)hash * table->frozen_buckets) >> 64);
+}
+
+size_t ht_robin_control_size(size_t capacity);
+void ht_robin_init_control(uint8_t *control_bytes, size_t capacity);
+size_t ht_robin_find(const HashTable *table, const void *key,
+                     key_equal_function equal, uint64_t hash,
+                     size_t *insert_index);
+size_t ht_robin_find_free(const HashTable *table, uint64_t hash);
+size_t ht_robin_find_local(const HashTable *table, const void *key,
+                           key_equal_function equal, uint64_t hash,
+                           size_t end, size_t *insert_index);
+bool ht_robin_occupy(HashTable *table, size_t index, uint64_t hash);
+void ht_robin_release(HashTable *table, size_t index);
+bool ht_robin_is_occupied(const HashTable *table, size_t index);
+size_t ht_robin_find_frozen(const HashTable *table, const void *key,
+                            key_equal_function equal, uint64_t hash);
+void ht_robin_scan_bucket(const HashTable *table, size_t bucket,
+                          scan_function fn, void *ctx);
+
+#endif
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "hashtable.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DEFAULT_MIN_SIZE (1024 * 1024)
+#define HUGE_2MB ((size_t)2 << 20)
+#define HUGE_1GB ((size_t)1 << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+// mbind() modes, from <linux/mempolicy.h>.
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MAX_NODES 64
+
+struct hash_pages {
+  hash_pages_options options;
+  uint64_t nodes;           // numa_nodes, or the online nodes
+  _Atomic size_t mapped;    // bytes currently mapped
+  _Atomic size_t fallbacks; // hugetlb mappings that got normal pages
+};
+
+// Length of the mapping behind an allocation of size bytes. It depends on
+// the size alone, so free() can work it out again, including for mappings
+// that fell back from MAP_HUGETLB to normal pages.
+static size_t mapping_length(const hash_pages *pages, size_t size) {
+  size_t page = pages->options.page_size == HASH_PAGES_HUGE_1GB ? HUGE_1GB
+                                                                 : HUGE_2MB;
+  return (size + page - 1) & ~(page - 1);
+}
+
+// Nodes listed in /sys/devices/system/node/online, such as "0-3,6".
+static uint64_t online_nodes(void) {
+  FILE *file = fopen("/sys/devices/system/node/online", "r");
+  if (!file)
+    return 1;
+  uint64_t nodes = 0;
+  unsigned first, last;
+  int c = ',';
+  while (c == ',' && fscanf(file, "%u", &first) == 1) {
+    last = first;
+    c = fgetc(file);
+    if (c == '-' && fscanf(file, "%u", &last) == 1)
+      c = fgetc(file);
+    for (unsigned node = first; node <= last && node < MAX_NODES; node++)
+      nodes |= (uint64_t)1 << node;
+  }
+  fclose(file);
+  return nodes ? nodes : 1;
+}
+
+hash_pages *hash_pages_create(const hash_pages_options *options) {
+  hash_pages *pages = malloc(sizeof(hash_pages));
+  if (!pages)
+    return NULL;
+  pages->options = options ? *options : (hash_pages_options){0};
+  if (pages->options.min_size == 0)
+    pages->options.min_size = DEFAULT_MIN_SIZE;
+  pages->nodes = pages->options.numa_nodes;
+  if (pages->options.numa_policy == HASH_PAGES_NUMA_INTERLEAVE &&
+      pages->nodes == 0)
+    pages->nodes = online_nodes();
+  if (pages->options.numa_policy != HASH_PAGES_NUMA_DEFAULT &&
+      pages->nodes == 0) {
+    free(pages);
+    return NULL;
+  }
+  atomic_init(&pages->mapped, 0);
+  atomic_init(&pages->fallbacks, 0);
+  return pages;
+}
+
+void hash_pages_destroy(hash_pages *pages) { free(pages); }
+
+void hash_pages_usage(const hash_pages *pages, size_t *mapped,
+                      size_t *fallbacks) {
+  if (mapped)
+    *mapped = atomic_load_explicit(&pages->mapped, memory_order_relaxed);
+  if (fallbacks)
+    *fallbacks =
+        atomic_load_explicit(&pages->fallbacks, memory_order_relaxed);
+}
+
+// Maps length bytes from the reserved huge page pool, or returns NULL if
+// it has too few free pages of that size.
+static void *map_hugetlb(const hash_pages *pages, size_t length) {
+  int log2_page = pages->options.page_size == HASH_PAGES_HUGE_1GB ? 30 : 21;
+  void *ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                       (log2_page << MAP_HUGE_SHIFT),
+                   -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+// Maps length bytes of normal pages starting on a 2 MiB boundary, so that
+// transparent huge pages can back all of it, and asks for them.
+static void *map_transparent(size_t length) {
+  size_t padded = length + HUGE_2MB;
+  unsigned char *ptr = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+  unsigned char *start =
+      (unsigned char *)(((uintptr_t)ptr + HUGE_2MB - 1) & ~(HUGE_2MB - 1));
+  if (start > ptr)
+    munmap(ptr, (size_t)(start - ptr));
+  size_t tail = (size_t)(ptr + padded - (start + length));
+  if (tail)
+    munmap(start + length, tail);
+  // Only a hint: without THP support the memory is still usable.
+  madvise(start, length, MADV_HUGEPAGE);
+  return start;
+}
+
+static bool apply_numa_policy(const hash_pages *pages, void *ptr,
+                              size_t length) {
+  if (pages->options.numa_policy == HASH_PAGES_NUMA_DEFAULT)
+    return true;
+#ifdef SYS_mbind
+  int mode = pages->options.numa_policy == HASH_PAGES_NUMA_BIND
+                 ? MPOL_BIND
+                 : MPOL_INTERLEAVE;
+  unsigned long nodemask = (unsigned long)pages->nodes;
+  return syscall(SYS_mbind, ptr, length, mode, &nodemask,
+                 (unsigned long)MAX_NODES + 1, 0) == 0;
+#else
+  (void)ptr;
+  (void)length;
+  return false;
+#endif
+}
+
+static void *pages_alloc(void *ctx, size_t size, size_t alignment) {
+  hash_pages *pages = ctx;
+  if (size < pages->options.min_size) {
+    if (alignment <= _Alignof(max_align_t))
+      return malloc(size);
+    return aligned_alloc(alignment,
+                         (size + alignment - 1) & ~(alignment - 1));
+  }
+
+  size_t length = mapping_length(pages, size);
+  void *ptr = NULL;
+  if (pages->options.page_size != HASH_PAGES_TRANSPARENT) {
+    ptr = map_hugetlb(pages, length);
+    if (!ptr && pages->options.require_hugetlb)
+      return NULL;
+    if (!ptr)
+      atomic_fetch_add_explicit(&pages->fallbacks, 1, memory_order_relaxed);
+  }
+  if (!ptr)
+    ptr = map_transparent(length);
+  if (!ptr)
+    return NULL;
+  // Pages are placed when first touched, which is after this returns.
+  if (!apply_numa_policy(pages, ptr, length)) {
+    munmap(ptr, length);
+    return NULL;
+  }
+  atomic_fetch_add_explicit(&pages->mapped, length, memory_order_relaxed);
+  return ptr;
+}
+
+static void pages_free(void *ctx, void *ptr, size_t size) {
+  hash_pages *pages = ctx;
+  if (!ptr)
+    return;
+  if (size < pages->options.min_size) {
+    free(ptr);
+    return;
+  }
+  size_t length = mapping_length(pages, size);
+  munmap(ptr, length);
+  atomic_fetch_sub_explicit(&pages->mapped, length, memory_order_relaxed);
+}
+
+context_allocator hash_pages_allocator(hash_pages *pages) {
+  return (context_allocator){pages_alloc, pages_free, NULL, pages};
+}
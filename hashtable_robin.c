@@ -0,0 +1,219 @@
+#include "hashtable_internal.h"
+#include <string.h>
+
+// Robin Hood engine. Every slot has one control byte holding 0 for an empty
+// slot, or 1 + the entry's distance from its home slot. Entries are kept
+// ordered so that no entry is further from home than the one before it
+// plus one: an insert takes the slot of the first entry that is closer to
+// home than the new key would be and shifts the rest of the run along. A
+// lookup can therefore stop as soon as it has probed further than the
+// slot's own entry, and deletes shift the following entries back instead
+// of leaving tombstones.
+
+#define CTRL_EMPTY 0
+#define MAX_DISTANCE HT_ROBIN_MAX_DISTANCE
+
+static inline size_t distance_at(const HashTable *table, size_t index) {
+  return (size_t)table->control_bytes[index] - 1;
+}
+
+size_t ht_robin_control_size(size_t capacity) { return capacity; }
+
+void ht_robin_init_control(uint8_t *control_bytes, size_t capacity) {
+  memset(control_bytes, CTRL_EMPTY, capacity);
+}
+
+size_t ht_robin_find(const HashTable *table, const void *key,
+                     key_equal_function equal, uint64_t hash,
+                     size_t *insert_index) {
+  size_t mask = table->capacity - 1;
+  size_t index = hash & mask;
+  size_t insert_at = SLOT_NONE;
+
+  for (size_t distance = 0; distance <= MAX_DISTANCE; distance++) {
+    uint8_t ctrl = table->control_bytes[index];
+    if (ctrl == CTRL_EMPTY || (size_t)ctrl - 1 < distance) {
+      HT_STATS_PROBES(distance + 1);
+      insert_at = index;
+      break;
+    }
+    if ((size_t)ctrl - 1 == distance &&
+        (!table->hashes || table->hashes[index] == hash) &&
+        ht_key_equal(table, equal, index, key)) {
+      HT_STATS_PROBES(distance + 1);
+      return index;
+    }
+    index = (index + 1) & mask;
+  }
+
+  if (insert_index) {
+    *insert_index = insert_at;
+  }
+  return SLOT_NONE;
+}
+
+size_t ht_robin_find_free(const HashTable *table, uint64_t hash) {
+  size_t mask = table->capacity - 1;
+  size_t index = hash & mask;
+
+  for (size_t distance = 0; distance <= MAX_DISTANCE; distance++) {
+    uint8_t ctrl = table->control_bytes[index];
+    if (ctrl == CTRL_EMPTY || (size_t)ctrl - 1 < distance) {
+      return index;
+    }
+    index = (index + 1) & mask;
+  }
+  return SLOT_NONE;
+}
+
+// The insertion slot only counts if the run it shifts along ends before
+// end, which keeps ht_robin_occupy() below end too.
+size_t ht_robin_find_local(const HashTable *table, const void *key,
+                           key_equal_function equal, uint64_t hash,
+                           size_t end, size_t *insert_index) {
+  size_t index = hash & (table->capacity - 1);
+  *insert_index = SLOT_NONE;
+  for (size_t distance = 0; distance <= MAX_DISTANCE && index < end;
+       distance++, index++) {
+    uint8_t ctrl = table->control_bytes[index];
+    if (ctrl == CTRL_EMPTY || (size_t)ctrl - 1 < distance) {
+      for (size_t last = index; last < end; last++) {
+        if (table->control_bytes[last] == CTRL_EMPTY) {
+          *insert_index = index;
+          break;
+        }
+      }
+      break;
+    }
+    if (key && (size_t)ctrl - 1 == distance &&
+        (!table->hashes || table->hashes[index] == hash) &&
+        ht_key_equal(table, equal, index, key))
+      return index;
+  }
+  return SLOT_NONE;
+}
+
+// Shifts the run starting at index one slot to the right to make room for
+// the new entry. Fails without changing anything when an entry in the run
+// would move beyond MAX_DISTANCE; the caller then has to grow the table.
+bool ht_robin_occupy(HashTable *table, size_t index, uint64_t hash) {
+  size_t mask = table->capacity - 1;
+  size_t distance = (index - (hash & mask)) & mask;
+
+  size_t end = index;
+  while (table->control_bytes[end] != CTRL_EMPTY) {
+    if (distance_at(table, end) == MAX_DISTANCE)
+      return false;
+    end = (end + 1) & mask;
+  }
+
+  while (end != index) {
+    size_t prev = (end - 1) & mask;
+    table->control_bytes[end] = table->control_bytes[prev] + 1;
+    ht_move_entry(table, end, prev);
+    end = prev;
+  }
+  table->control_bytes[index] = (uint8_t)(distance + 1);
+  return true;
+}
+
+// Backward-shift deletion: entries after the freed slot move back by one
+// until an empty slot or an entry already in its home slot is reached.
+void ht_robin_release(HashTable *table, size_t index) {
+  size_t mask = table->capacity - 1;
+  size_t next = (index + 1) & mask;
+
+  while (table->control_bytes[next] > 1) {
+    table->control_bytes[index] = table->control_bytes[next] - 1;
+    ht_move_entry(table, index, next);
+    index = next;
+    next = (next + 1) & mask;
+  }
+  table->control_bytes[index] = CTRL_EMPTY;
+  ht_clear_entry(table, index);
+}
+
+bool ht_robin_is_occupied(const HashTable *table, size_t index) {
+  return table->control_bytes[index] != CTRL_EMPTY;
+}
+
+// A frozen table ends in HT_FROZEN_TAIL empty slots, past every run, so its
+// probes stop before they reach the end without wrapping, and may read the
+// control bytes of a whole group at a time. A key can only be in the slots
+// whose distance is their offset from its home; the probe ends at the first
+// slot whose distance is smaller, an empty one included.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+size_t ht_robin_find_frozen(const HashTable *table, const void *key,
+                            key_equal_function equal, uint64_t hash) {
+  size_t home = ht_frozen_home(table, hash);
+  // 1 + the offset of each slot of the group from home, saturating at 255.
+  // Past that point every saturated slot counts as own, which costs only
+  // extra key compares; the closer mask still ends the probe at the first
+  // slot with a smaller distance or an empty one.
+  __m128i expected = _mm_setr_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+                                   14, 15, 16);
+  const __m128i step = _mm_set1_epi8(HT_FROZEN_TAIL);
+  for (size_t base = home;; base += HT_FROZEN_TAIL) {
+    __m128i ctrl =
+        _mm_loadu_si128((const __m128i *)(table->control_bytes + base));
+    unsigned own = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, expected));
+    unsigned closer = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                          _mm_max_epu8(ctrl, expected), expected)) &
+                      ~own;
+    if (closer)
+      own &= (closer & -closer) - 1;
+    for (; own; own &= own - 1) {
+      size_t index = base + (size_t)__builtin_ctz(own);
+      if ((!table->hashes || table->hashes[index] == hash) &&
+          ht_key_equal(table, equal, index, key)) {
+        HT_STATS_PROBES(index - home + 1);
+        return index;
+      }
+    }
+    if (closer) {
+      HT_STATS_PROBES(base - home + (size_t)__builtin_ctz(closer) + 1);
+      return SLOT_NONE;
+    }
+    expected = _mm_adds_epu8(expected, step);
+  }
+}
+
+#else
+
+size_t ht_robin_find_frozen(const HashTable *table, const void *key,
+                            key_equal_function equal, uint64_t hash) {
+  const uint8_t *control_bytes = table->control_bytes;
+  size_t index = ht_frozen_home(table, hash);
+  for (size_t distance = 0;; distance++, index++) {
+    uint8_t ctrl = control_bytes[index];
+    if (ctrl == CTRL_EMPTY || (size_t)ctrl - 1 < distance) {
+      HT_STATS_PROBES(distance + 1);
+      return SLOT_NONE;
+    }
+    if ((size_t)ctrl - 1 == distance &&
+        (!table->hashes || table->hashes[index] == hash) &&
+        ht_key_equal(table, equal, index, key)) {
+      HT_STATS_PROBES(distance + 1);
+      return index;
+    }
+  }
+}
+#endif
+
+// The entries with this home slot are the ones found at distance d after it
+// while walking the run. The walk ends where a lookup would.
+void ht_robin_scan_bucket(const HashTable *table, size_t bucket,
+                          scan_function fn, void *ctx) {
+  size_t mask = table->frozen_buckets ? SIZE_MAX : table->capacity - 1;
+  size_t index = bucket;
+  for (size_t distance = 0; distance <= MAX_DISTANCE; distance++) {
+    uint8_t ctrl = table->control_bytes[index];
+    if (ctrl == CTRL_EMPTY || (size_t)ctrl - 1 < distance)
+      break;
+    if ((size_t)ctrl - 1 == distance)
+      fn(ht_entry_key(table, index), ht_entry_value(table, index), ctx);
+    index = (index + 1) & mask;
+  }
+}
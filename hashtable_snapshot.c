@@ -0,0 +1,518 @@
+#define _POSIX_C_SOURCE 200809L
+#include "hashtable_internal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "HTSNAP\r\n"
+#define SNAPSHOT_VERSION 4
+// Written in host byte order; reads back differently on the other one.
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+// Arrays start on cache-line boundaries within the file, and the mapping
+// itself is page aligned.
+#define SNAPSHOT_ALIGNMENT 64
+#define SNAPSHOT_CACHE_HASHES 0x1u
+#define SNAPSHOT_INCREMENTAL_RESIZE 0x2u
+#define SNAPSHOT_SEPARATE_VALUES 0x4u
+#define SNAPSHOT_FLAGS                                                         \
+  (SNAPSHOT_CACHE_HASHES | SNAPSHOT_INCREMENTAL_RESIZE |                       \
+   SNAPSHOT_SEPARATE_VALUES)
+// Slots copied out at a time while writing, so free ones can be zeroed.
+#define WRITE_CHUNK 1024
+
+// The file starts with this header, followed by the control bytes, the
+// entries and, for tables that cache hashes, the hashes, each at the
+// offset recorded here. Offsets are from the start of the file, so the
+// mapping can land at any address.
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t engine;
+  uint32_t flags;
+  double max_load_factor;
+  uint64_t seed; // entries sit where the seeded hash put them
+  uint64_t key_size;
+  uint64_t value_size;
+  uint64_t entry_size;
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t tombstones;
+  uint64_t control_offset;
+  uint64_t control_size;
+  uint64_t entries_offset;
+  uint64_t entries_size; // with separate values, the values too
+  uint64_t hashes_offset; // 0 without cached hashes
+  uint64_t file_size;
+  uint64_t frozen_buckets; // 0 unless written by a frozen table
+};
+
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + SNAPSHOT_ALIGNMENT - 1) &
+         ~(uint64_t)(SNAPSHOT_ALIGNMENT - 1);
+}
+
+static bool write_padding(FILE *file, uint64_t *offset, uint64_t target) {
+  static const unsigned char zeros[SNAPSHOT_ALIGNMENT];
+  size_t size = target - *offset;
+  *offset = target;
+  return fwrite(zeros, 1, size, file) == size;
+}
+
+// Writes a per-slot array of stride bytes per slot with the free slots
+// zeroed, as arrays allocated by an incremental resize leave them
+// uninitialized.
+static bool write_slots(FILE *file, const HashTable *table,
+                        const unsigned char *data, size_t stride) {
+  unsigned char *buffer = malloc(stride * WRITE_CHUNK);
+  if (!buffer)
+    return false;
+  bool ok = true;
+  for (size_t start = 0; ok && start < table->capacity; start += WRITE_CHUNK) {
+    size_t n = table->capacity - start < WRITE_CHUNK ? table->capacity - start
+                                                     : WRITE_CHUNK;
+    memcpy(buffer, data + start * stride, n * stride);
+    for (size_t i = 0; i < n; i++) {
+      if (!ht_is_occupied(table, start + i))
+        memset(buffer + i * stride, 0, stride);
+    }
+    ok = fwrite(buffer, stride, n, file) == n;
+  }
+  free(buffer);
+  return ok;
+}
+
+static bool write_snapshot(FILE *file, const HashTable *table) {
+  struct snapshot_header header = {0};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.engine = table->engine;
+  header.flags = (table->hashes ? SNAPSHOT_CACHE_HASHES : 0) |
+                 (table->incremental_resize ? SNAPSHOT_INCREMENTAL_RESIZE : 0) |
+                 (table->separate_values ? SNAPSHOT_SEPARATE_VALUES : 0);
+  header.max_load_factor = table->max_load_factor;
+  header.seed = table->seed;
+  header.key_size = table->key_size;
+  header.value_size = table->value_size;
+  header.entry_size = table->entry_size;
+  header.capacity = table->capacity;
+  header.count = table->count;
+  header.tombstones = table->tombstones;
+  header.frozen_buckets = table->frozen_buckets;
+  header.control_offset = align_offset(sizeof(header));
+  header.control_size = ht_control_size(table, table->capacity);
+  header.entries_offset =
+      align_offset(header.control_offset + header.control_size);
+  header.entries_size = ht_entries_size(table, table->capacity);
+  header.file_size = header.entries_offset + header.entries_size;
+  if (table->hashes) {
+    header.hashes_offset = align_offset(header.file_size);
+    header.file_size =
+        header.hashes_offset + sizeof(uint64_t) * table->capacity;
+  }
+
+  uint64_t offset = sizeof(header);
+  if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+      !write_padding(file, &offset, header.control_offset) ||
+      fwrite(table->control_bytes, 1, header.control_size, file) !=
+          header.control_size)
+    return false;
+  offset += header.control_size;
+  if (!write_padding(file, &offset, header.entries_offset) ||
+      !write_slots(file, table, table->entries, table->entry_size))
+    return false;
+  offset += table->entry_size * table->capacity;
+  if (table->separate_values) {
+    uint64_t values_offset =
+        header.entries_offset + ht_values_offset(table, table->capacity);
+    if (!write_padding(file, &offset, values_offset) ||
+        !write_slots(file, table, table->values, table->value_stride))
+      return false;
+    offset += table->value_stride * table->capacity;
+  }
+  return !table->hashes ||
+         (write_padding(file, &offset, header.hashes_offset) &&
+          write_slots(file, table, (const unsigned char *)table->hashes,
+                      sizeof(uint64_t)));
+}
+
+bool hash_table_save(HashTable *table, const char *path) {
+  if (!table->key_size || !table->value_size || table->bounded ||
+      table->expiry)
+    return false;
+  hash_table_resize_step(table, SIZE_MAX);
+
+  size_t path_length = strlen(path);
+  char *temp_path = malloc(path_length + sizeof(".tmp"));
+  if (!temp_path)
+    return false;
+  memcpy(temp_path, path, path_length);
+  memcpy(temp_path + path_length, ".tmp", sizeof(".tmp"));
+
+  FILE *file = fopen(temp_path, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = write_snapshot(file, table) && fflush(file) == 0 &&
+         fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp_path, path) == 0;
+    if (!ok)
+      remove(temp_path);
+  }
+  free(temp_path);
+  return ok;
+}
+
+// Checks everything in the header that does not need a table to compare
+// against, including that every array lies within the file.
+static bool header_valid(const struct snapshot_header *header, size_t size) {
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION ||
+      header->byte_order != SNAPSHOT_BYTE_ORDER ||
+      header->engine > HASH_TABLE_ENGINE_ROBIN_HOOD ||
+      (header->flags & ~SNAPSHOT_FLAGS) ||
+      !ht_load_factor_valid(header->max_load_factor) ||
+      header->file_size != size || !header->key_size || !header->value_size ||
+      !header->entry_size)
+    return false;
+  uint64_t capacity = header->capacity;
+  if (header->engine == HASH_TABLE_ENGINE_SWISS &&
+      capacity < HT_SWISS_GROUP_WIDTH)
+    return false;
+  // A frozen layout has more slots than homes, and ends in empty ones.
+  uint64_t buckets = header->frozen_buckets;
+  if (buckets && (header->engine != HASH_TABLE_ENGINE_ROBIN_HOOD ||
+                  capacity < HT_FROZEN_TAIL ||
+                  buckets > capacity - HT_FROZEN_TAIL ||
+                  header->count > capacity - HT_FROZEN_TAIL))
+    return false;
+  if (capacity == 0 || (!buckets && (capacity & (capacity - 1))) ||
+      header->count > capacity ||
+      header->tombstones > capacity - header->count)
+    return false;
+  if (header->control_offset % SNAPSHOT_ALIGNMENT ||
+      header->entries_offset % SNAPSHOT_ALIGNMENT ||
+      header->hashes_offset % SNAPSHOT_ALIGNMENT)
+    return false;
+  if (header->control_offset < sizeof(*header) ||
+      header->control_offset > size ||
+      header->control_size > size - header->control_offset)
+    return false;
+  if (header->entries_offset > size ||
+      header->entries_size > size - header->entries_offset ||
+      capacity > header->entries_size / header->entry_size)
+    return false;
+  // The key leads each entry, and the value follows it unless the values
+  // have an array of their own; either way both fit in the entries array,
+  // so the sizes are no larger than the file.
+  if (header->entry_size % INLINE_ALIGNMENT ||
+      header->key_size > header->entry_size)
+    return false;
+  if (header->flags & SNAPSHOT_SEPARATE_VALUES
+          ? header->value_size > header->entries_size / capacity
+          : header->value_size > header->entry_size -
+                                     ht_align_up(header->key_size,
+                                                 INLINE_ALIGNMENT))
+    return false;
+  bool cache_hashes = header->flags & SNAPSHOT_CACHE_HASHES;
+  if (cache_hashes != (header->hashes_offset != 0))
+    return false;
+  return !cache_hashes ||
+         (header->hashes_offset <= size &&
+          capacity <= (size - header->hashes_offset) / sizeof(uint64_t));
+}
+
+// Whether the last HT_FROZEN_TAIL slots of a frozen layout are empty, which
+// keeps every probe within the control bytes whatever the others hold.
+static bool frozen_tail_empty(const uint8_t *control_bytes,
+                              uint64_t capacity) {
+  for (uint64_t i = capacity - HT_FROZEN_TAIL; i < capacity; i++) {
+    if (control_bytes[i] != 0)
+      return false;
+  }
+  return true;
+}
+
+HashTable *hash_table_open_mmap(const char *path, type_handler key_handler,
+                                bool copy_on_write) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (uint64_t)st.st_size < sizeof(struct snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = (size_t)st.st_size;
+  // Private either way: copy-on-write changes must never reach the file.
+  void *mapping =
+      mmap(NULL, size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ,
+           MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return NULL;
+
+  const struct snapshot_header *header = mapping;
+  HashTable *table = NULL;
+  if (header_valid(header, size)) {
+    hash_table_options options = {
+        .engine = header->engine,
+        .max_load_factor = header->max_load_factor,
+        .cache_hashes = header->flags & SNAPSHOT_CACHE_HASHES,
+        .key_size = header->key_size,
+        .value_size = header->value_size,
+        .incremental_resize = header->flags & SNAPSHOT_INCREMENTAL_RESIZE,
+        .seed = header->seed,
+        .separate_values = header->flags & SNAPSHOT_SEPARATE_VALUES,
+    };
+    table = hash_table_create_with_options(key_handler, (type_handler){0},
+                                           NULL, &options);
+  }
+  // The layout the table would use must be the one on file, and a frozen
+  // one must end in the empty slots its probes stop at.
+  if (table && (table->entry_size != header->entry_size ||
+                ht_entries_size(table, header->capacity) !=
+                    header->entries_size ||
+                ht_control_size(table, header->capacity) !=
+                    header->control_size ||
+                (header->frozen_buckets &&
+                 !frozen_tail_empty(
+                     (const uint8_t *)mapping + header->control_offset,
+                     header->capacity)))) {
+    hash_table_destroy(table);
+    table = NULL;
+  }
+  if (!table) {
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  unsigned char *base = mapping;
+  ht_set_slots(table, header->capacity, base + header->control_offset,
+               base + header->entries_offset,
+               header->hashes_offset
+                   ? (uint64_t *)(base + header->hashes_offset)
+                   : NULL);
+  table->count = header->count;
+  table->tombstones = header->tombstones;
+  table->mapping = mapping;
+  table->mapping_size = size;
+  // Frozen tables stay read-only even in a writable mapping, since their
+  // layout is one the engine cannot insert into.
+  table->frozen_buckets = header->frozen_buckets;
+  table->read_only = !copy_on_write || header->frozen_buckets;
+  return table;
+}
+
+void ht_unmap_snapshot(HashTable *table) {
+  munmap(table->mapping, table->mapping_size);
+}
+
+#define STREAM_MAGIC "HTSTREAM"
+#define STREAM_VERSION 1
+#define STREAM_HEADER_SIZE 40
+// Bytes gathered before the sink is called.
+#define STREAM_CHUNK 4096
+// Entries the loader reserves room for at a time. The count in the header
+// is not trusted with more, so a corrupt one cannot make the table
+// allocate far more than the stream holds.
+#define STREAM_RESERVE_BATCH 65536
+
+// Stream header fields are little-endian on every machine. Inline keys and
+// values are written as they are in memory.
+static void put_u32(unsigned char *out, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void put_u64(unsigned char *out, uint64_t value) {
+  for (int i = 0; i < 8; i++)
+    out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static uint32_t get_u32(const unsigned char *in) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+    value |= (uint32_t)in[i] << (8 * i);
+  return value;
+}
+
+static uint64_t get_u64(const unsigned char *in) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value |= (uint64_t)in[i] << (8 * i);
+  return value;
+}
+
+// Gathers small writes, including those of encode hooks, into one chunk.
+// Writes that do not fit in an empty chunk go straight to the sink.
+struct stream_buffer {
+  const hash_table_writer *sink;
+  size_t used;
+  unsigned char data[STREAM_CHUNK];
+};
+
+static bool flush_buffer(struct stream_buffer *buffer) {
+  if (buffer->used == 0)
+    return true;
+  size_t used = buffer->used;
+  buffer->used = 0;
+  return buffer->sink->write(buffer->sink->ctx, buffer->data, used);
+}
+
+static bool buffer_write(void *ctx, const void *data, size_t size) {
+  struct stream_buffer *buffer = ctx;
+  if (size > STREAM_CHUNK - buffer->used) {
+    if (!flush_buffer(buffer))
+      return false;
+    if (size > STREAM_CHUNK)
+      return buffer->sink->write(buffer->sink->ctx, data, size);
+  }
+  memcpy(buffer->data + buffer->used, data, size);
+  buffer->used += size;
+  return true;
+}
+
+static bool write_data(const hash_table_writer *writer,
+                       const type_handler *handler, const void *data,
+                       size_t inline_size) {
+  if (inline_size)
+    return writer->write(writer->ctx, data, inline_size);
+  return handler->encode(data, writer);
+}
+
+bool hash_table_serialize_stream(const HashTable *table,
+                                 const hash_table_writer *writer) {
+  if ((!table->key_size && !table->key_handler.encode) ||
+      (!table->value_size && !table->value_handler.encode))
+    return false;
+
+  struct stream_buffer buffer = {.sink = writer};
+  hash_table_writer buffered = {buffer_write, &buffer};
+  unsigned char header[STREAM_HEADER_SIZE];
+  memcpy(header, STREAM_MAGIC, 8);
+  put_u32(header + 8, STREAM_VERSION);
+  put_u32(header + 12, 0); // flags, none yet
+  put_u64(header + 16, hash_table_count(table));
+  put_u64(header + 24, table->key_size);
+  put_u64(header + 32, table->value_size);
+  bool ok = buffer_write(&buffer, header, sizeof(header));
+
+  hash_table_iterator it = hash_table_iter(table);
+  void *key, *value;
+  while (ok && hash_table_iter_next(&it, &key, &value)) {
+    ok = write_data(&buffered, &table->key_handler, key, table->key_size) &&
+         write_data(&buffered, &table->value_handler, value,
+                    table->value_size);
+  }
+  return ok && flush_buffer(&buffer);
+}
+
+// Reads one side of an entry: inline bytes into inline_buffer, returned as
+// is, or a decoded object. Returns NULL on error.
+static void *read_data(const hash_table_reader *reader,
+                       const type_handler *handler, void *inline_buffer,
+                       size_t inline_size) {
+  if (inline_size)
+    return reader->read(reader->ctx, inline_buffer, inline_size)
+               ? inline_buffer
+               : NULL;
+  return handler->decode(reader);
+}
+
+// Where the value goes in a scratch buffer holding a key and a value, so
+// that both are aligned for any type as they reach the handlers.
+static size_t scratch_value_offset(const HashTable *table) {
+  return (table->key_size + ALLOC_ALIGNMENT - 1) & ~(ALLOC_ALIGNMENT - 1);
+}
+
+// Loads count entries whose keys and values are both inline, reading as
+// many whole entries at a time as fit in a chunk. In the stream they are
+// packed, so each is copied to aligned scratch space before it is
+// inserted.
+static bool load_inline(HashTable *table, const hash_table_reader *reader,
+                        uint64_t count) {
+  size_t pair_size = table->key_size + table->value_size;
+  size_t per_chunk = pair_size < STREAM_CHUNK ? STREAM_CHUNK / pair_size : 1;
+  size_t value_offset = scratch_value_offset(table);
+  unsigned char *chunk = malloc(pair_size * per_chunk);
+  unsigned char *scratch = malloc(value_offset + table->value_size);
+  bool ok = chunk && scratch;
+  while (ok && count > 0) {
+    size_t n = count < per_chunk ? (size_t)count : per_chunk;
+    ok = reader->read(reader->ctx, chunk, pair_size * n);
+    for (size_t i = 0; ok && i < n; i++) {
+      unsigned char *pair = chunk + i * pair_size;
+      memcpy(scratch, pair, table->key_size);
+      memcpy(scratch + value_offset, pair + table->key_size,
+             table->value_size);
+      ok = hash_table_insert_owned(table, scratch, scratch + value_offset);
+    }
+    count -= n;
+  }
+  free(chunk);
+  free(scratch);
+  return ok;
+}
+
+static bool load_entries(HashTable *table, const hash_table_reader *reader,
+                         uint64_t count) {
+  size_t value_offset = scratch_value_offset(table);
+  size_t inline_size = value_offset + table->value_size;
+  unsigned char *inline_buffer = inline_size ? malloc(inline_size) : NULL;
+  if (inline_size && !inline_buffer)
+    return false;
+  bool ok = true;
+  for (; ok && count > 0; count--) {
+    void *key = read_data(reader, &table->key_handler, inline_buffer,
+                          table->key_size);
+    void *value =
+        key ? read_data(reader, &table->value_handler,
+                        inline_buffer + value_offset, table->value_size)
+            : NULL;
+    ok = value && hash_table_insert_owned(table, key, value);
+    if (!ok) {
+      // Whatever was decoded is still ours.
+      if (key && !table->key_size)
+        ht_destroy_data(table, &table->key_handler, key);
+      if (value && !table->value_size)
+        ht_destroy_data(table, &table->value_handler, value);
+    }
+  }
+  free(inline_buffer);
+  return ok;
+}
+
+bool hash_table_deserialize_stream(HashTable *table,
+                                   const hash_table_reader *reader) {
+  if ((!table->key_size && !table->key_handler.decode) ||
+      (!table->value_size && !table->value_handler.decode))
+    return false;
+
+  unsigned char header[STREAM_HEADER_SIZE];
+  if (!reader->read(reader->ctx, header, sizeof(header)) ||
+      memcmp(header, STREAM_MAGIC, 8) != 0 ||
+      get_u32(header + 8) != STREAM_VERSION ||
+      get_u64(header + 24) != table->key_size ||
+      get_u64(header + 32) != table->value_size)
+    return false;
+  uint64_t count = get_u64(header + 16);
+  if (count > SIZE_MAX - hash_table_count(table))
+    return false;
+
+  bool ok = true;
+  while (ok && count > 0) {
+    uint64_t n = count < STREAM_RESERVE_BATCH ? count : STREAM_RESERVE_BATCH;
+    ok = hash_table_reserve(table, hash_table_count(table) + (size_t)n) &&
+         (table->key_size && table->value_size
+              ? load_inline(table, reader, n)
+              : load_entries(table, reader, n));
+    count -= n;
+  }
+  return ok;
+}
@@ -0,0 +1,245 @@
+#include "hashtable_internal.h"
+#include <string.h>
+
+// SwissTable-style engine. Every slot has one control byte: CTRL_EMPTY,
+// CTRL_DELETED, or the low 7 bits of the key's hash (h2) with the top bit
+// clear. Slots are grouped into aligned runs of GROUP_WIDTH, and a probe
+// compares h2 against a whole group at once, so only slots whose
+// fingerprint matches reach the equal handler. Groups are visited in
+// triangular order, which covers every group of a power-of-two table.
+
+#define GROUP_WIDTH HT_SWISS_GROUP_WIDTH
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7F))
+
+// A group_mask has one set bit per matching slot. On NEON each slot owns a
+// nibble of the mask, so the bit index is scaled down by GROUP_MASK_SHIFT.
+typedef uint64_t group_mask;
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GROUP_MASK_SHIFT 0
+
+typedef __m128i group;
+
+static inline group group_load(const uint8_t *ctrl) {
+  return _mm_loadu_si128((const __m128i *)ctrl);
+}
+
+static inline group_mask group_match(group g, uint8_t h2) {
+  return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+}
+
+// EMPTY and DELETED are the only control bytes with the top bit set.
+static inline group_mask group_match_free(group g) {
+  return (uint16_t)_mm_movemask_epi8(g);
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GROUP_MASK_SHIFT 2
+
+typedef uint8x16_t group;
+
+static inline group group_load(const uint8_t *ctrl) { return vld1q_u8(ctrl); }
+
+// Narrows a 0x00/0xFF per-lane comparison result to 4 bits per lane.
+static inline group_mask group_movemask(uint8x16_t cmp) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+         0x8888888888888888ULL;
+}
+
+static inline group_mask group_match(group g, uint8_t h2) {
+  return group_movemask(vceqq_u8(g, vdupq_n_u8(h2)));
+}
+
+static inline group_mask group_match_free(group g) {
+  return group_movemask(vcltzq_s8(vreinterpretq_s8_u8(g)));
+}
+
+#else
+#define GROUP_MASK_SHIFT 0
+
+typedef const uint8_t *group;
+
+static inline group group_load(const uint8_t *ctrl) { return ctrl; }
+
+static inline group_mask group_match(group g, uint8_t h2) {
+  group_mask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (group_mask)(g[i] == h2) << i;
+  }
+  return mask;
+}
+
+static inline group_mask group_match_free(group g) {
+  group_mask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (group_mask)(g[i] >> 7) << i;
+  }
+  return mask;
+}
+#endif
+
+static inline group_mask group_match_empty(group g) {
+  return group_match(g, CTRL_EMPTY);
+}
+
+static inline size_t mask_first(group_mask mask) {
+  return (size_t)__builtin_ctzll(mask) >> GROUP_MASK_SHIFT;
+}
+
+size_t ht_swiss_control_size(size_t capacity) { return capacity; }
+
+void ht_swiss_init_control(uint8_t *control_bytes, size_t capacity) {
+  memset(control_bytes, CTRL_EMPTY, capacity);
+}
+
+size_t ht_swiss_home(const HashTable *table, uint64_t hash) {
+  return (H1(hash) & (table->capacity / GROUP_WIDTH - 1)) * GROUP_WIDTH;
+}
+
+size_t ht_swiss_find(const HashTable *table, const void *key,
+                     key_equal_function equal, uint64_t hash,
+                     size_t *insert_index) {
+  size_t group_count_mask = table->capacity / GROUP_WIDTH - 1;
+  size_t g = H1(hash) & group_count_mask;
+  uint8_t h2 = H2(hash);
+  size_t free_index = SLOT_NONE;
+
+  for (size_t step = 1; step <= group_count_mask + 1; step++) {
+    size_t base = g * GROUP_WIDTH;
+    group ctrl = group_load(table->control_bytes + base);
+
+    for (group_mask m = group_match(ctrl, h2); m; m &= m - 1) {
+      size_t index = base + mask_first(m);
+      if ((!table->hashes || table->hashes[index] == hash) &&
+          ht_key_equal(table, equal, index, key)) {
+        HT_STATS_PROBES(step);
+        return index;
+      }
+    }
+
+    group_mask free_slots = group_match_free(ctrl);
+    if (free_index == SLOT_NONE && free_slots) {
+      free_index = base + mask_first(free_slots);
+    }
+    if (group_match_empty(ctrl)) {
+      HT_STATS_PROBES(step);
+      break;
+    }
+    g = (g + step) & group_count_mask;
+  }
+
+  if (insert_index) {
+    *insert_index = free_index;
+  }
+  return SLOT_NONE;
+}
+
+size_t ht_swiss_find_free(const HashTable *table, uint64_t hash) {
+  size_t group_count_mask = table->capacity / GROUP_WIDTH - 1;
+  size_t g = H1(hash) & group_count_mask;
+
+  for (size_t step = 1;; step++) {
+    size_t base = g * GROUP_WIDTH;
+    group_mask free_slots =
+        group_match_free(group_load(table->control_bytes + base));
+    if (free_slots) {
+      return base + mask_first(free_slots);
+    }
+    g = (g + step) & group_count_mask;
+  }
+}
+
+// Probes the home group only. Slots are never freed while arrays are being
+// filled, so a key added earlier is found there unless the group was
+// already full then, and it still is: the key is left for a full probe.
+size_t ht_swiss_find_local(const HashTable *table, const void *key,
+                           key_equal_function equal, uint64_t hash,
+                           size_t *insert_index) {
+  size_t base = ht_swiss_home(table, hash);
+  group ctrl = group_load(table->control_bytes + base);
+  if (key) {
+    for (group_mask m = group_match(ctrl, H2(hash)); m; m &= m - 1) {
+      size_t index = base + mask_first(m);
+      if ((!table->hashes || table->hashes[index] == hash) &&
+          ht_key_equal(table, equal, index, key))
+        return index;
+    }
+  }
+  group_mask free_slots = group_match_free(ctrl);
+  *insert_index = free_slots ? base + mask_first(free_slots) : SLOT_NONE;
+  return SLOT_NONE;
+}
+
+void ht_swiss_occupy(HashTable *table, size_t index, uint64_t hash) {
+  if (table->control_bytes[index] == CTRL_DELETED) {
+    table->tombstones--;
+  }
+  table->control_bytes[index] = H2(hash);
+}
+
+// A group that still has an EMPTY slot never caused a probe to move past
+// it, so a slot freed there can go straight back to EMPTY. Otherwise some
+// probe sequence may run through it and it has to become a tombstone.
+void ht_swiss_release(HashTable *table, size_t index) {
+  size_t base = index & ~(size_t)(GROUP_WIDTH - 1);
+  if (group_match_empty(group_load(table->control_bytes + base))) {
+    table->control_bytes[index] = CTRL_EMPTY;
+  } else {
+    table->control_bytes[index] = CTRL_DELETED;
+    table->tombstones++;
+  }
+}
+
+bool ht_swiss_is_occupied(const HashTable *table, size_t index) {
+  return (table->control_bytes[index] & 0x80) == 0;
+}
+
+bool ht_swiss_is_deleted(const HashTable *table, size_t index) {
+  return table->control_bytes[index] == CTRL_DELETED;
+}
+
+void ht_swiss_clear(HashTable *table, size_t index) {
+  table->control_bytes[index] = CTRL_EMPTY;
+}
+
+void ht_swiss_mark_for_rehash(HashTable *table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    uint8_t ctrl = table->control_bytes[i];
+    table->control_bytes[i] = (ctrl & 0x80) ? CTRL_EMPTY : CTRL_DELETED;
+  }
+}
+
+size_t ht_swiss_scan_buckets(const HashTable *table) {
+  return table->capacity / GROUP_WIDTH;
+}
+
+// Follows the probe sequence of the group as a lookup would, up to the
+// first group with an empty slot, picking out the entries that started
+// there.
+void ht_swiss_scan_bucket(const HashTable *table, size_t bucket,
+                          scan_function fn, void *ctx) {
+  size_t group_count_mask = table->capacity / GROUP_WIDTH - 1;
+  size_t g = bucket;
+  for (size_t step = 1; step <= group_count_mask + 1; step++) {
+    size_t base = g * GROUP_WIDTH;
+    for (size_t i = base; i < base + GROUP_WIDTH; i++) {
+      if (!ht_swiss_is_occupied(table, i))
+        continue;
+      uint64_t hash = table->hashes
+                          ? table->hashes[i]
+                          : ht_hash_key(table, ht_entry_key(table, i));
+      if ((H1(hash) & group_count_mask) == bucket)
+        fn(ht_entry_key(table, i), ht_entry_value(table, i), ctx);
+    }
+    if (group_match_empty(group_load(table->control_bytes + base)))
+      break;
+    g = (g + step) & group_count_mask;
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef CUSTOM_HASH_TABLE_TYPED_H
+#define CUSTOM_HASH_TABLE_TYPED_H
+
+// Type-specialized tables generated from a macro. HT_DEFINE(name, K, V,
+// hash_fn, eq_fn) defines an opaque type `name` and these functions:
+//
+//   name *name_create(size_t initial_capacity);
+//   void name_destroy(name *map);
+//   V *name_lookup(const name *map, K key);
+//   bool name_insert(name *map, K key, V value);
+//   bool name_delete(name *map, K key);
+//   size_t name_count(const name *map);
+//   HashTable *name_table(name *map);
+//
+// hash_fn is called as uint64_t hash_fn(const K *key) and eq_fn as
+// bool eq_fn(const K *a, const K *b). Both are called directly rather than
+// through a type_handler, so when they are inline functions the compiler
+// inlines them, and the probe loop around them, into every lookup.
+//
+// The map is a HashTable with inline keys and values on the LINEAR engine.
+// Only the probes are generated: growing, adding new keys and removing
+// entries go through hashtable.c, and they share its probe loop,
+// ht_linear_find_with(). K and V are copied with memcpy, so they must be
+// plain data, at most 8-byte aligned. name_lookup() returns a pointer into
+// the table that stays valid until the next insert or delete. name_table()
+// gives the underlying HashTable for the rest of the generic API, such as
+// iteration or hash_table_reserve().
+//
+//   static inline uint64_t hash_u64(const uint64_t *key) { return *key; }
+//   static inline bool eq_u64(const uint64_t *a, const uint64_t *b) {
+//     return *a == *b;
+//   }
+//   HT_DEFINE(u64_map, uint64_t, uint64_t, hash_u64, eq_u64)
+
+#include "hashtable_internal.h"
+
+#define HT_DEFINE(name, K, V, hash_fn, eq_fn)                                  \
+  _Static_assert(_Alignof(K) <= INLINE_ALIGNMENT &&                            \
+                     _Alignof(V) <= INLINE_ALIGNMENT,                          \
+                 #name ": K and V must be at most 8-byte aligned");            \
+                                                                               \
+  typedef struct name name;                                                    \
+                                                                               \
+  static inline uint64_t name##_hash_handler(const void *key) {                \
+    return hash_fn((const K *)key);                                            \
+  }                                                                            \
+  static inline bool name##_equal_handler(const void *a, const void *b) {      \
+    return eq_fn((const K *)a, (const K *)b);                                  \
+  }                                                                            \
+  static inline bool name##_match(const HashTable *table, size_t index,        \
+                                  const void *key, uint64_t key_hash) {        \
+    (void)key_hash;                                                            \
+    return eq_fn((const K *)ht_entry(table, index), (const K *)key);           \
+  }                                                                            \
+  static inline size_t name##_find(const HashTable *table, const K *key,       \
+                                   uint64_t key_hash) {                        \
+    return ht_linear_find_with(table, key, key_hash, NULL, name##_match);      \
+  }                                                                            \
+                                                                               \
+  static inline name *name##_create(size_t initial_capacity) {                 \
+    type_handler key_handler = {.equal = name##_equal_handler,                 \
+                                .hash = name##_hash_handler};                  \
+    hash_table_options options = {.key_size = sizeof(K),                       \
+                                  .value_size = sizeof(V),                     \
+                                  .initial_capacity = initial_capacity};       \
+    return (name *)hash_table_create_with_options(                             \
+        key_handler, (type_handler){0}, NULL, &options);                       \
+  }                                                                            \
+  static inline void name##_destroy(name *map) {                               \
+    hash_table_destroy((HashTable *)map);                                      \
+  }                                                                            \
+  static inline HashTable *name##_table(name *map) {                           \
+    return (HashTable *)map;                                                   \
+  }                                                                            \
+  static inline size_t name##_count(const name *map) {                         \
+    return hash_table_count((const HashTable *)map);                           \
+  }                                                                            \
+                                                                               \
+  static inline V *name##_lookup(const name *map, K key) {                     \
+    const HashTable *table = (const HashTable *)map;                           \
+    size_t index = name##_find(table, &key, ht_mix_hash(hash_fn(&key)));       \
+    return index != SLOT_NONE ? (V *)ht_value_slot(table, index) : NULL;       \
+  }                                                                            \
+  static inline bool name##_insert(name *map, K key, V value) {                \
+    HashTable *table = (HashTable *)map;                                       \
+    uint64_t key_hash = ht_mix_hash(hash_fn(&key));                            \
+    size_t index = name##_find(table, &key, key_hash);                         \
+    if (index != SLOT_NONE) {                                                  \
+      memcpy(ht_value_slot(table, index), &value, sizeof(V));                  \
+      return true;                                                             \
+    }                                                                          \
+    return ht_insert_absent(table, &key, key_hash, &value);                    \
+  }                                                                            \
+  static inline bool name##_delete(name *map, K key) {                         \
+    HashTable *table = (HashTable *)map;                                       \
+    size_t index = name##_find(table, &key, ht_mix_hash(hash_fn(&key)));       \
+    if (index == SLOT_NONE)                                                    \
+      return false;                                                            \
+    ht_erase(table, index);                                                    \
+    return true;                                                               \
+  }
+
+#endif
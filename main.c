@@ -13,16 +13,12 @@ typedef struct {
   char metadata[64];
 } user_value;
 
+// Hashes the same fields equal_user_key compares: the name up to its NUL,
+// then the id, chained through the seed.
 uint64_t hash_user_key(const void *key) {
   const user_key *uk = (const user_key *)key;
-  uint64_t hash = 5381;
-  hash = ((hash << 5) + hash) ^ uk->id;
-  const char *p = uk->name;
-  int c;
-  while ((c = *p++)) {
-    hash = ((hash << 5) + hash) ^ c;
-  }
-  return hash;
+  uint64_t hash = hash_table_hash_string(uk->name, 0, 0);
+  return hash_table_hash_bytes(&uk->id, sizeof(uk->id), hash);
 }
 
 bool equal_user_key(const void *key1, const void *key2) {
@@ -0,0 +1,166 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sharded_hashtable.h"
+#include "hashtable_internal.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define DEFAULT_SHARD_COUNT 16
+#define CACHE_LINE_SIZE 64
+
+// Each shard sits on its own cache line(s), so taking one shard's lock
+// does not invalidate the line holding a neighbour's.
+struct shard {
+  _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+  HashTable *table;
+};
+
+struct ShardedHashTable {
+  struct shard *shards;
+  size_t shard_count;
+  unsigned shard_shift; // 64 - log2(shard_count)
+  type_handler key_handler;
+  size_t key_size;
+  uint64_t seed;
+};
+
+// All shards share the key handler, key size and seed, so whichever shard
+// hashes a key gets the same value the shard was chosen by.
+static struct shard *shard_for(const ShardedHashTable *table, uint64_t hash) {
+  size_t index = table->shard_count > 1 ? hash >> table->shard_shift : 0;
+  return &table->shards[index];
+}
+
+static uint64_t hash_key(const ShardedHashTable *table, const void *key) {
+  return ht_hash_with(&table->key_handler, key, table->key_size, table->seed);
+}
+
+static size_t split_bound(size_t total, size_t shard_count, size_t shard) {
+  return total / shard_count + (shard < total % shard_count);
+}
+
+ShardedHashTable *
+sharded_hash_table_create(type_handler key_handler, type_handler value_handler,
+                          const sharded_hash_table_options *options) {
+  sharded_hash_table_options opts =
+      options ? *options : (sharded_hash_table_options){0};
+  if (opts.shard_count == 0)
+    opts.shard_count = DEFAULT_SHARD_COUNT;
+  if (opts.shard_count & (opts.shard_count - 1))
+    return NULL;
+  // A shard bound of 0 would mean unbounded, so every shard needs at least
+  // one entry and one byte of the totals.
+  if ((opts.table_options.max_entries &&
+       opts.table_options.max_entries < opts.shard_count) ||
+      (opts.table_options.max_bytes &&
+       opts.table_options.max_bytes < opts.shard_count))
+    return NULL;
+
+  ShardedHashTable *table = malloc(sizeof(ShardedHashTable));
+  if (!table)
+    return NULL;
+  table->shards =
+      aligned_alloc(CACHE_LINE_SIZE, sizeof(struct shard) * opts.shard_count);
+  if (!table->shards) {
+    free(table);
+    return NULL;
+  }
+  table->shard_count = opts.shard_count;
+  table->shard_shift = 64;
+  for (size_t n = opts.shard_count; n > 1; n >>= 1)
+    table->shard_shift--;
+  table->key_handler = key_handler;
+  table->key_size = opts.table_options.key_size;
+  table->seed = opts.table_options.seed;
+
+  hash_table_options shard_options = opts.table_options;
+  shard_options.initial_capacity =
+      (opts.table_options.initial_capacity + opts.shard_count - 1) /
+      opts.shard_count;
+
+  for (size_t i = 0; i < opts.shard_count; i++) {
+    struct shard *shard = &table->shards[i];
+    // The bounds round down, and the first total % shard_count shards take
+    // one more, so the shards add up to exactly the caller's totals.
+    shard_options.max_entries = split_bound(opts.table_options.max_entries,
+                                            opts.shard_count, i);
+    shard_options.max_bytes =
+        split_bound(opts.table_options.max_bytes, opts.shard_count, i);
+    if (opts.shard_allocators)
+      shard_options.allocator = &opts.shard_allocators[i];
+    shard->table = hash_table_create_with_options(key_handler, value_handler,
+                                                  NULL, &shard_options);
+    if (!shard->table || pthread_rwlock_init(&shard->lock, NULL) != 0) {
+      hash_table_destroy(shard->table);
+      table->shard_count = i;
+      sharded_hash_table_destroy(table);
+      return NULL;
+    }
+  }
+  return table;
+}
+
+void sharded_hash_table_destroy(ShardedHashTable *table) {
+  if (!table)
+    return;
+  for (size_t i = 0; i < table->shard_count; i++) {
+    pthread_rwlock_destroy(&table->shards[i].lock);
+    hash_table_destroy(table->shards[i].table);
+  }
+  free(table->shards);
+  free(table);
+}
+
+bool sharded_hash_table_insert(ShardedHashTable *table, void *key,
+                               void *value) {
+  uint64_t hash = hash_key(table, key);
+  struct shard *shard = shard_for(table, hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  bool inserted = ht_insert_hashed(shard->table, key, hash, value);
+  pthread_rwlock_unlock(&shard->lock);
+  return inserted;
+}
+
+void *sharded_hash_table_lookup(const ShardedHashTable *table,
+                                const void *key) {
+  uint64_t hash = hash_key(table, key);
+  struct shard *shard = shard_for(table, hash);
+  pthread_rwlock_rdlock(&shard->lock);
+  void *value = ht_lookup_hashed(shard->table, key, hash);
+  pthread_rwlock_unlock(&shard->lock);
+  return value;
+}
+
+bool sharded_hash_table_lookup_with(const ShardedHashTable *table,
+                                    const void *key, value_visit_function visit,
+                                    void *ctx) {
+  uint64_t hash = hash_key(table, key);
+  struct shard *shard = shard_for(table, hash);
+  pthread_rwlock_rdlock(&shard->lock);
+  void *value = ht_lookup_hashed(shard->table, key, hash);
+  if (value)
+    visit(value, ctx);
+  pthread_rwlock_unlock(&shard->lock);
+  return value != NULL;
+}
+
+bool sharded_hash_table_delete(ShardedHashTable *table, const void *key) {
+  uint64_t hash = hash_key(table, key);
+  struct shard *shard = shard_for(table, hash);
+  pthread_rwlock_wrlock(&shard->lock);
+  bool deleted = ht_delete_hashed(shard->table, key, hash);
+  pthread_rwlock_unlock(&shard->lock);
+  return deleted;
+}
+
+// Shards are counted one at a time, so with concurrent writers the total
+// is only a snapshot.
+size_t sharded_hash_table_count(const ShardedHashTable *table) {
+  size_t count = 0;
+  for (size_t i = 0; i < table->shard_count; i++) {
+    struct shard *shard = &table->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    count += hash_table_count(shard->table);
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  return count;
+}
@@ -0,0 +1,47 @@
+#ifndef CUSTOM_SHARDED_HASH_TABLE_H
+#define CUSTOM_SHARDED_HASH_TABLE_H
+
+#include "hashtable.h"
+
+// A thread-safe table made of independent HashTable shards. Keys are
+// spread over the shards by the top bits of their hash, and every shard
+// has its own reader-writer lock on its own cache line, so threads working
+// on different shards never contend.
+
+typedef struct {
+  // Number of shards, a power of two. 0 selects 16.
+  size_t shard_count;
+  // Options applied to every shard. initial_capacity, max_entries and
+  // max_bytes are totals for the whole table and are split evenly between
+  // shards, each of which evicts on its own, under its write lock. A
+  // nonzero max_entries or max_bytes below shard_count is rejected.
+  // allocator is ignored when shard_allocators is set.
+  hash_table_options table_options;
+  // Optional array of shard_count allocators, one per shard.
+  const context_allocator *shard_allocators;
+} sharded_hash_table_options;
+
+typedef struct ShardedHashTable ShardedHashTable;
+
+// Called with the shard's read lock held.
+typedef void (*value_visit_function)(void *value, void *ctx);
+
+// options may be NULL.
+ShardedHashTable *
+sharded_hash_table_create(type_handler key_handler, type_handler value_handler,
+                          const sharded_hash_table_options *options);
+void sharded_hash_table_destroy(ShardedHashTable *table);
+bool sharded_hash_table_insert(ShardedHashTable *table, void *key, void *value);
+// Returns the stored value without holding any lock once it returns. Only
+// safe when no other thread can delete or replace the key meanwhile; use
+// sharded_hash_table_lookup_with() otherwise.
+void *sharded_hash_table_lookup(const ShardedHashTable *table, const void *key);
+// Calls visit on the value while the shard is read-locked. Returns false,
+// without calling visit, if the key is not present.
+bool sharded_hash_table_lookup_with(const ShardedHashTable *table,
+                                    const void *key, value_visit_function visit,
+                                    void *ctx);
+bool sharded_hash_table_delete(ShardedHashTable *table, const void *key);
+size_t sharded_hash_table_count(const ShardedHashTable *table);
+
+#endif